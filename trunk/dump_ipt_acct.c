@@ -23,14 +23,19 @@
 
 /* $Id$ */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <linux/netlink.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
@@ -39,6 +44,16 @@
 
 #include "ipt_ACCT.h"
 
+/* Number of records read at once. */
+#define READ_RECORDS 256
+
+/* Socket buffer for netlink messages, large enough to take a burst of
+   dumps. */
+#define LISTEN_RCVBUF (4 * 1024 * 1024)
+
+/* Bytes spliced at once, the default capacity of a pipe. */
+#define SPLICE_BYTES (16 * 4096)
+
 #define ERROR(msg,...) \
   fprintf (stderr, "dump_ipt_acct: " msg "\n", ## __VA_ARGS__)
 
@@ -48,6 +63,12 @@ static const struct option options[] =
   { "help", 0, 0, 0 },
   { "proto-names", 0, 0, 's' },
   { "proto-numbers", 0, 0, 'd' },
+  { "cpus", 0, 0, 'c' },
+  { "generation", 0, 0, 'g' },
+  { "mmap", 0, 0, 'm' },
+  { "listen", 1, 0, 'l' },
+  { "ring", 0, 0, 'r' },
+  { "append", 1, 0, 'a' },
   { 0, 0, 0, 0}
 };
 
@@ -61,6 +82,21 @@ Options:\n\
      Try to print names of protocols instead of numbers if possible.\n\
   -d, --proto-numbers\n\
      Print protocols in numeric form (default).\n\
+  -c, --cpus\n\
+     Print number of CPU that has accounted the record.\n\
+  -g, --generation\n\
+     Print sequence number, start and end times of the dump first.\n\
+  -m, --mmap\n\
+     Read records in place from the module memory instead of copying them.\n\
+  -l, --listen UNIT\n\
+     Print dumps as they are multicast over netlink protocol UNIT (the\n\
+     netlink_unit module parameter) until interrupted.\n\
+  -r, --ring\n\
+     Print records as they come through the ring (the ring_records module\n\
+     parameter) until interrupted.\n\
+  -a, --append FILE\n\
+     Append raw records of the dump to FILE, moving them through a pipe\n\
+     instead of copying them into the program.\n\
   --version\n\
      Print program version and exit.\n\
   --help\n\
@@ -73,22 +109,355 @@ version ()
   printf ("dump_ipt_acct %s\n", IPT_ACCT_VERSION);
 }
 
+static int proto_names_p = 0;
+static int cpus_p = 0;
+
+static void
+print_generation (const struct ipt_acct_generation *generation)
+{
+  printf ("# %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+          generation->seq, generation->start_ts, generation->end_ts);
+}
+
+static void
+print_records (const struct ipt_acct_record *records, unsigned int n)
+{
+  unsigned int i;
+  char src[] = "XXX.XXX.XXX.XXX";
+  char dst[] = "XXX.XXX.XXX.XXX";
+
+  if (proto_names_p)
+    for (i = 0; i < n; ++i)
+      {
+        struct protoent *p = getprotobynumber (records[i].proto);
+        inet_ntop (AF_INET, &records[i].src, src, sizeof (src));
+        inet_ntop (AF_INET, &records[i].dst, dst, sizeof (dst));
+        if (p)
+          printf ("%u %s %u %s %u %u %u %s %" PRIu64 " %" PRIu64,
+                  records[i].magic,
+                  src, records[i].sport, dst, records[i].dport,
+                  records[i].npkts, records[i].size, p->p_name,
+                  records[i].first, records[i].last);
+        else
+          printf ("%u %s %u %s %u %u %u %u %" PRIu64 " %" PRIu64,
+                  records[i].magic,
+                  src, records[i].sport, dst, records[i].dport,
+                  records[i].npkts, records[i].size, records[i].proto,
+                  records[i].first, records[i].last);
+        if (cpus_p)
+          printf (" %u", records[i].cpu);
+        printf ("\n");
+      }
+  else
+    for (i = 0; i < n; ++i)
+      {
+        inet_ntop (AF_INET, &records[i].src, src, sizeof (src));
+        inet_ntop (AF_INET, &records[i].dst, dst, sizeof (dst));
+        printf ("%u %s %u %s %u %u %u %u %" PRIu64 " %" PRIu64,
+                records[i].magic,
+                src, records[i].sport, dst, records[i].dport,
+                records[i].npkts, records[i].size, records[i].proto,
+                records[i].first, records[i].last);
+        if (cpus_p)
+          printf (" %u", records[i].cpu);
+        printf ("\n");
+      }
+}
+
+/* Hold the oldest complete dump, map it read-only and print the records
+   straight from the module memory. */
+static int
+dump_in_place (int acct_dev, int generation_p)
+{
+  struct ipt_acct_generation generation;
+  struct ipt_acct_record *records = NULL;
+  size_t length;
+
+  if (ioctl (acct_dev, IPT_ACCT_HOLD_DUMP, &generation) == -1)
+    {
+      if (errno == EAGAIN)
+        return 0;
+
+      ERROR ("IPT_ACCT_HOLD_DUMP: %s", strerror (errno));
+      return 3;
+    }
+
+  length = generation.nrecords * sizeof (struct ipt_acct_record);
+
+  if (length != 0)
+    {
+      records = mmap (NULL, length, PROT_READ, MAP_SHARED, acct_dev,
+                      generation.offset);
+
+      if (records == MAP_FAILED)
+        {
+          ERROR ("Mapping of /dev/%s failed: %s", IPT_ACCT_DEVICE,
+                 strerror (errno));
+          ioctl (acct_dev, IPT_ACCT_RELEASE_DUMP);
+          return 3;
+        }
+
+      if (generation_p)
+        print_generation (&generation);
+
+      print_records (records, generation.nrecords);
+      munmap (records, length);
+    }
+
+  if (ioctl (acct_dev, IPT_ACCT_RELEASE_DUMP) == -1)
+    {
+      ERROR ("IPT_ACCT_RELEASE_DUMP: %s", strerror (errno));
+      return 3;
+    }
+
+  return 0;
+}
+
+/* Read the oldest dump through a small buffer, a chunk at a time. */
+static int
+dump_by_reading (int acct_dev, int generation_p)
+{
+  struct ipt_acct_generation generation;
+  struct ipt_acct_record records[READ_RECORDS];
+  ssize_t n;
+
+  /* Holding the dump only describes it, read() goes on with it. */
+  if (generation_p)
+    {
+      if (ioctl (acct_dev, IPT_ACCT_HOLD_DUMP, &generation) == -1)
+        {
+          if (errno == EAGAIN)
+            return 0;
+
+          ERROR ("IPT_ACCT_HOLD_DUMP: %s", strerror (errno));
+          return 3;
+        }
+
+      print_generation (&generation);
+    }
+
+  while ((n = read (acct_dev, records, sizeof (records))) > 0)
+    print_records (records, n / sizeof (struct ipt_acct_record));
+
+  if (n < 0 && errno != EAGAIN)
+    {
+      ERROR ("Reading of /dev/%s failed: %s", IPT_ACCT_DEVICE,
+             strerror (errno));
+      return 3;
+    }
+
+  return 0;
+}
+
+/* Splice the oldest dump into the end of PATH through a pipe, so that
+   records never reach our memory. */
+static int
+dump_by_splicing (int acct_dev, const char *path)
+{
+  int fd, pipefd[2];
+  ssize_t n, m;
+
+  fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+  if (fd < 0)
+    {
+      ERROR ("%s: %s", path, strerror (errno));
+      return 2;
+    }
+
+  if (pipe (pipefd) < 0)
+    {
+      ERROR ("Pipe: %s", strerror (errno));
+      return 3;
+    }
+
+  while ((n = splice (acct_dev, NULL, pipefd[1], NULL, SPLICE_BYTES,
+                      SPLICE_F_MOVE)) > 0)
+    for (; n > 0; n -= m)
+      {
+        m = splice (pipefd[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+
+        if (m <= 0)
+          {
+            ERROR ("Writing of %s failed: %s", path, strerror (errno));
+            return 3;
+          }
+      }
+
+  if (n < 0 && errno != EAGAIN)
+    {
+      ERROR ("Splicing of /dev/%s failed: %s", IPT_ACCT_DEVICE,
+             strerror (errno));
+      return 3;
+    }
+
+  close (pipefd[0]);
+  close (pipefd[1]);
+
+  if (close (fd) < 0)
+    {
+      ERROR ("%s: %s", path, strerror (errno));
+      return 3;
+    }
+
+  return 0;
+}
+
+/* Print generations multicast by the module until interrupted. */
+static int
+dump_by_listening (int unit, int generation_p)
+{
+  static char buf[64 * 1024];
+  struct sockaddr_nl addr;
+  struct nlmsghdr *nlh;
+  int sock, rcvbuf = LISTEN_RCVBUF;
+  ssize_t len;
+
+  sock = socket (AF_NETLINK, SOCK_RAW, unit);
+
+  if (sock < 0)
+    {
+      ERROR ("Netlink protocol %d: %s", unit, strerror (errno));
+      return 2;
+    }
+
+  setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+  bzero (&addr, sizeof (addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1 << (IPT_ACCT_NLGRP - 1);
+
+  if (bind (sock, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      ERROR ("Netlink protocol %d: %s", unit, strerror (errno));
+      return 2;
+    }
+
+  while (1)
+    {
+      len = recv (sock, buf, sizeof (buf), 0);
+
+      if (len < 0)
+        {
+          if (errno == ENOBUFS)
+            {
+              ERROR ("Netlink messages lost, the rest of the dump is "
+                     "incomplete");
+              continue;
+            }
+          if (errno == EINTR)
+            continue;
+
+          ERROR ("Receiving from netlink failed: %s", strerror (errno));
+          return 3;
+        }
+
+      for (nlh = (struct nlmsghdr *) buf; NLMSG_OK (nlh, len);
+           nlh = NLMSG_NEXT (nlh, len))
+        switch (nlh->nlmsg_type)
+          {
+          case IPT_ACCT_NLMSG_GENERATION:
+            if (generation_p)
+              print_generation (NLMSG_DATA (nlh));
+            break;
+          case IPT_ACCT_NLMSG_RECORDS:
+            print_records (NLMSG_DATA (nlh),
+                           (nlh->nlmsg_len - NLMSG_LENGTH (0))
+                           / sizeof (struct ipt_acct_record));
+            break;
+          case NLMSG_DONE:
+            fflush (stdout);
+            break;
+          }
+    }
+}
+
+/* Print records from the ring until interrupted, waking up once the
+   module has put enough of them in. */
+static int
+dump_by_streaming (int acct_dev)
+{
+  struct ipt_acct_ring_info info;
+  volatile struct ipt_acct_ring *ring;
+  volatile struct ipt_acct_ring_tail *ring_tail;
+  struct ipt_acct_record *records;
+  struct pollfd pfd;
+  long page_size = sysconf (_SC_PAGESIZE);
+  __u64 head, tail;
+  unsigned int n;
+
+  if (ioctl (acct_dev, IPT_ACCT_GET_RING, &info) == -1)
+    {
+      ERROR ("IPT_ACCT_GET_RING: %s", strerror (errno));
+      return 3;
+    }
+
+  /* Only the tail page may be, and has to be, mapped writable. */
+  ring = mmap (NULL, info.length, PROT_READ, MAP_SHARED, acct_dev,
+               info.offset);
+  ring_tail = mmap (NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    acct_dev, info.offset + page_size);
+
+  if (ring == MAP_FAILED || ring_tail == MAP_FAILED)
+    {
+      ERROR ("Mapping of /dev/%s failed: %s", IPT_ACCT_DEVICE,
+             strerror (errno));
+      return 3;
+    }
+
+  records = (struct ipt_acct_record *) ((char *) ring + 2 * page_size);
+  bzero (&pfd, sizeof (pfd));
+  pfd.fd = acct_dev;
+  pfd.events = POLLIN;
+
+  while (1)
+    {
+      if (poll (&pfd, 1, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          ERROR ("Polling of /dev/%s failed: %s", IPT_ACCT_DEVICE,
+                 strerror (errno));
+          return 3;
+        }
+
+      head = ring->head;
+      tail = ring_tail->tail;
+      __sync_synchronize ();
+
+      while (tail != head)
+        {
+          n = ring->size - tail % ring->size;
+          if (n > head - tail)
+            n = head - tail;
+
+          print_records (records + tail % ring->size, n);
+          tail += n;
+        }
+
+      fflush (stdout);
+      __sync_synchronize ();
+      ring_tail->tail = tail;
+    }
+}
+
 int
 main (int argc, char * const argv[])
 {
   int c, option_index;
   int acct_dev;
-  int proto_names_p = 0;
-  struct ipt_acct_record *records;
-  unsigned int max_records, ndump, i;
+  int generation_p = 0;
+  int mmap_p = 0;
+  int listen_unit = 0;
+  int ring_p = 0;
+  const char *append_path = NULL;
 
   struct pollfd pfd;
-  char src[] = "XXX.XXX.XXX.XXX";
-  char dst[] = "XXX.XXX.XXX.XXX";
 
   while (1)
     {
-      c = getopt_long (argc, argv, "sd", options, &option_index);
+      c = getopt_long (argc, argv, "sdcgml:ra:", options, &option_index);
 
       if (c == -1)
         break;
@@ -107,6 +476,29 @@ main (int argc, char * const argv[])
         case 'd':
           proto_names_p = 0;
           break;
+        case 'c':
+          cpus_p = 1;
+          break;
+        case 'g':
+          generation_p = 1;
+          break;
+        case 'm':
+          mmap_p = 1;
+          break;
+        case 'l':
+          listen_unit = atoi (optarg);
+          if (listen_unit <= 0)
+            {
+              ERROR ("Wrong netlink protocol: %s", optarg);
+              return 1;
+            }
+          break;
+        case 'r':
+          ring_p = 1;
+          break;
+        case 'a':
+          append_path = optarg;
+          break;
         case '?':
           return 1;
         }
@@ -121,38 +513,30 @@ main (int argc, char * const argv[])
       return 1;
     }
 
-  acct_dev = open ("/dev/" IPT_ACCT_DEVICE, O_RDONLY);
+  if (listen_unit)
+    return dump_by_listening (listen_unit, generation_p);
 
-  if (acct_dev < 0)
+  if (ring_p)
     {
-      ERROR ("/dev/%s: %s", IPT_ACCT_DEVICE, strerror (errno));
-      return 2;
-    }
-
-  max_records = ioctl (acct_dev, IPT_ACCT_GET_MAX);
+      acct_dev = open ("/dev/" IPT_ACCT_DEVICE, O_RDWR);
 
-  if (max_records == (unsigned int) -1)
-    {
-      ERROR ("IPT_ACCT_GET_MAX: %s", strerror (errno));
-      return 3;
-    }
+      if (acct_dev < 0)
+        {
+          ERROR ("/dev/%s: %s", IPT_ACCT_DEVICE, strerror (errno));
+          return 2;
+        }
 
-  if (max_records == 0)
-    {
-      ERROR ("IPT_ACCT_GET_MAX has returned 0");
-      return 3;
+      return dump_by_streaming (acct_dev);
     }
 
-  records = malloc (max_records * sizeof (struct ipt_acct_record));
+  acct_dev = open ("/dev/" IPT_ACCT_DEVICE, O_RDONLY | O_NONBLOCK);
 
-  if (!records)
+  if (acct_dev < 0)
     {
-      ERROR ("Cannot allocate %u records: %s", max_records, strerror (errno));
-      return 4;
+      ERROR ("/dev/%s: %s", IPT_ACCT_DEVICE, strerror (errno));
+      return 2;
     }
 
-  bzero (records, max_records * sizeof (struct ipt_acct_record));
-
   if (ioctl (acct_dev, IPT_ACCT_DUMP) < 0)
     {
       ERROR ("IPT_ACCT_DUMP: %s", strerror (errno));
@@ -170,45 +554,12 @@ main (int argc, char * const argv[])
       return 3;
     }
 
-  ndump = ioctl (acct_dev, IPT_ACCT_GET_DUMP, records);
+  if (append_path)
+    return dump_by_splicing (acct_dev, append_path);
 
-  if (ndump == (unsigned int) -1)
-    {
-      ERROR ("IPT_ACCT_GET_DUMP: %s", strerror (errno));
-      return 3;
-    }
+  if (mmap_p)
+    return dump_in_place (acct_dev, generation_p);
 
-  if (proto_names_p)
-    for (i = 0; i < ndump; ++i)
-      {
-        struct protoent *p = getprotobynumber (records[i].proto);
-        inet_ntop (AF_INET, &records[i].src, src, sizeof (src));
-        inet_ntop (AF_INET, &records[i].dst, dst, sizeof (dst));
-        if (p)
-          printf ("%u %s %u %s %u %u %u %s %" PRIu64 " %" PRIu64 "\n",
-                  records[i].magic,
-                  src, records[i].sport, dst, records[i].dport,
-                  records[i].npkts, records[i].size, p->p_name,
-                  records[i].first, records[i].last);
-        else
-          printf ("%u %s %u %s %u %u %u %u %" PRIu64 " %" PRIu64 "\n",
-                  records[i].magic,
-                  src, records[i].sport, dst, records[i].dport,
-                  records[i].npkts, records[i].size, records[i].proto,
-                  records[i].first, records[i].last);
-      }
-  else
-    for (i = 0; i < ndump; ++i)
-      {
-        inet_ntop (AF_INET, &records[i].src, src, sizeof (src));
-        inet_ntop (AF_INET, &records[i].dst, dst, sizeof (dst));
-        printf ("%u %s %u %s %u %u %u %u %" PRIu64 " %" PRIu64 "\n",
-                records[i].magic,
-                src, records[i].sport, dst, records[i].dport,
-                records[i].npkts, records[i].size, records[i].proto,
-                records[i].first, records[i].last);
-      }
-
-  return 0;
+  return dump_by_reading (acct_dev, generation_p);
 }
 
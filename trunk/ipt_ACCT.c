@@ -30,12 +30,24 @@
 #include <linux/init.h>
 
 #include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <linux/time.h>
 #include <linux/timer.h>
 #include <linux/wait.h>
 #include <linux/spinlock.h>
+#include <linux/smp.h>
+#include <linux/cache.h>
 #include <linux/miscdevice.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/netlink.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 22)
+# include <linux/splice.h>
+#endif
 #include <asm/uaccess.h>
+#include <asm/atomic.h>
+#include <asm/semaphore.h>
+#include <asm/div64.h>
 
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -50,6 +62,13 @@
 # define get_seconds() CURRENT_TIME
 # define try_module_get(x) try_inc_mod_count(x)
 # define module_put(x) __MOD_DEC_USE_COUNT(x)
+# define cpu_possible(cpu) ((cpu) < smp_num_cpus)
+# define num_online_cpus() smp_num_cpus
+# include <linux/tqueue.h>
+# define work_struct tq_struct
+# define INIT_WORK(work,func,data) INIT_TQUEUE (work, func, data)
+# define schedule_work(work) schedule_task (work)
+# define flush_scheduled_work() flush_scheduled_tasks ()
 static inline void *
 skb_header_pointer(const struct sk_buff *skb, int offset,
                    int len, void *buffer)
@@ -64,6 +83,12 @@ skb_header_pointer(const struct sk_buff *skb, int offset,
 
   return buffer;
 }
+#else
+# include <linux/workqueue.h>
+#endif
+
+#ifdef CONFIG_COMPAT
+# include <linux/compat.h>
 #endif
 
 #include "ipt_ACCT.h"
@@ -79,23 +104,92 @@ module_param (max_records, uint, 0000);
 MODULE_PARM_DESC (max_records,
   "Maximum number of accouning records to hold in memory.");
 
+static unsigned int min_records = 0;
+module_param (min_records, uint, 0000);
+MODULE_PARM_DESC (min_records,
+  "Minimum number of accounting records to hold in memory. Tables grow "
+  "up to MAX_RECORDS when filled up and shrink back when idle. "
+  "Zero means MAX_RECORDS.");
+
 static unsigned int timeout = 0;
 module_param (timeout, uint, 0000);
 MODULE_PARM_DESC (timeout, 
-  "Dump records after TIMEOUT seconds. Zero means no dump.");
+  "Dump records every TIMEOUT seconds. Zero means no dump.");
+
+static unsigned int interval_ms = 0;
+module_param (interval_ms, uint, 0000);
+MODULE_PARM_DESC (interval_ms,
+  "Dump records every INTERVAL_MS milliseconds. Overrides TIMEOUT.");
+
+static unsigned int align_p = 0;
+module_param (align_p, bool, 0000);
+MODULE_PARM_DESC (align_p,
+  "Dump records at multiples of the interval of the wall clock time.");
 
 static unsigned int no_loss_p = 1;
 module_param (no_loss_p, bool, 0000);
 MODULE_PARM_DESC (no_loss_p, 
   "Drop new packets if accounting information has not been read.");
 
-static const unsigned int primes[] =
-{
-  13, 19, 29, 41, 59, 79, 107, 149, 197, 263, 347, 457, 599, 787, 1031,
-  1361, 1777, 2333, 3037, 3967, 5167, 6719, 8737, 11369, 14783,
-  19219, 24989, 32491, 42257, 54941, 71429, 92861, 120721, 156941,
-  204047, 265271, 344857, 448321
-};
+static unsigned int ngenerations = 2;
+module_param (ngenerations, uint, 0000);
+MODULE_PARM_DESC (ngenerations,
+  "Number of dump generations to hold in memory, including the one being "
+  "accounted (at least 2).");
+
+static unsigned int watermark = 90;
+module_param (watermark, uint, 0000);
+MODULE_PARM_DESC (watermark,
+  "Dump records in process context once WATERMARK percent of a table are "
+  "used, so that packets rarely have to wait for a full table to be "
+  "dumped.");
+
+static unsigned int poll_watermark = 0;
+module_param (poll_watermark, uint, 0000);
+MODULE_PARM_DESC (poll_watermark,
+  "Report POLLPRI to pollers once POLL_WATERMARK percent of the dump being "
+  "accounted are used, so that a collector can dump early. Zero means "
+  "never.");
+
+static unsigned int ts_hz = 1;
+module_param (ts_hz, uint, 0000);
+MODULE_PARM_DESC (ts_hz,
+  "Units of flow timestamps per second: 1 (default), 1000, 1000000 or "
+  "1000000000. The clock is read at most once per jiffy.");
+
+static unsigned int batch = 0;
+module_param (batch, uint, 0000);
+MODULE_PARM_DESC (batch,
+  "Buffer up to BATCH packets on every CPU and account them into the "
+  "tables at once (at most 256). Zero means no buffering.");
+
+static unsigned int batch_ms = 10;
+module_param (batch_ms, uint, 0000);
+MODULE_PARM_DESC (batch_ms,
+  "Account buffered packets at least every BATCH_MS milliseconds.");
+
+static unsigned int netlink_unit = 0;
+module_param (netlink_unit, uint, 0000);
+MODULE_PARM_DESC (netlink_unit,
+  "Multicast every dump to group IPT_ACCT_NLGRP of netlink protocol "
+  "NETLINK_UNIT. Zero means no netlink export.");
+
+static unsigned int ring_records = 0;
+module_param (ring_records, uint, 0000);
+MODULE_PARM_DESC (ring_records,
+  "Export dumps continuously through a ring of RING_RECORDS records mapped "
+  "by the reader (2.6 kernels only). Zero means no ring.");
+
+static unsigned int stat_ms = 0;
+module_param (stat_ms, uint, 0000);
+MODULE_PARM_DESC (stat_ms,
+  "Refresh the statistics page every STAT_MS milliseconds (2.6 kernels "
+  "only). Zero means no statistics page.");
+
+static unsigned int percpu_p = 0;
+module_param (percpu_p, bool, 0000);
+MODULE_PARM_DESC (percpu_p,
+  "Keep a separate accounting table on each CPU.");
 
 struct ipt_acct_info
 {
@@ -107,112 +201,775 @@ struct ipt_acct_info
   unsigned int retcode;
 };
 
-struct item
+/* Slot of an open addressing hash table. The key of a flow is kept
+   inline together with a byte of its hash value, so that probing a
+   chain reads consecutive memory and never touches records. RECORD is
+   the index of the flow record in the acct pool plus one. A slot is in
+   use only if GEN equals the generation of its table, so all slots are
+   emptied at once by advancing the latter. */
+struct slot
 {
-  struct item *next;
-  struct ipt_acct_record *record;
+  __u32 src;
+  __u32 dst;
+  __u16 sport;
+  __u16 dport;
+  __u16 magic;
+  __u8 proto;
+  __u8 sig;
+  __u32 record;
+  __u32 gen;
+};
+
+#define SLOT_KEY_SIZE offsetof (struct slot, record)
+/* Size of the flow part of the key, without the hash byte. */
+#define SLOT_FLOW_SIZE offsetof (struct slot, sig)
+
+/* Hash table of accounted flows. There is only one table unless
+   percpu_p is set, in which case every CPU accounts packets into its own
+   table and never touches the others. Records of all tables are allocated
+   from the same pool, so a dump is still a single array. The number of
+   slots is a power of two at least 1.5 times CAPACITY, so a table is never
+   more than 2/3 full.
+
+   Tables are emptied on every dump by advancing GEN, so resizing needs no
+   rehashing:
+   slots for the new size are prepared in process context as NEXT_SLOTS
+   and put in place by the dump that starts the first generation of the
+   new size. Replaced slots are kept in OLD_SLOTS until freed. */
+struct ipt_acct_table
+{
+  spinlock_t lock;
+  struct slot *slots;
+  unsigned int mask;
+  unsigned int nused;
+  unsigned int capacity;
+  __u32 gen;
+  struct slot *next_slots;
+  unsigned int next_mask;
+  unsigned int next_capacity;
+  struct slot *old_slots;
+  /* Pool new records are taken from. A dump moves the tables to the new
+     acct pool one at a time, under their locks. */
+  struct ipt_acct_pool *pool;
+} ____cacheline_aligned;
+
+static struct ipt_acct_table tables[NR_CPUS];
+static unsigned int ntables;
+
+#define for_each_table(table) \
+  for (table = &tables[0]; table < &tables[ntables]; ++table) \
+    if (table->slots)
+
+/* Pools form a ring of NGENERATIONS dump generations. Packets are
+   accounted into the pool at ACCT_INDEX, the NPENDING pools before it hold
+   completed generations waiting to be read (the oldest first), and the
+   rest are free. NUSED counts the records taken from the pool while it is
+   accounted to, NRECORDS, SEQ and the timestamps describe a completed
+   generation. */
+struct ipt_acct_pool
+{
+  struct ipt_acct_record *records;
+  unsigned int size;
+  atomic_t nused;
+  unsigned int nrecords;
+  __u64 seq;
+  __u64 start_ts;
+  __u64 end_ts;
 };
 
-static struct item *item_pool_0, *item_pool_1;
-static struct item *acct_item_pool, *dump_item_pool;
-static struct item *free_item;
+static struct ipt_acct_pool *pools;
+static struct ipt_acct_pool *acct_pool;
+static unsigned int acct_index;
+static unsigned int npending;
+
+static struct ipt_acct_generation last_generation;
 
-static struct ipt_acct_record *pool_0, *pool_1;
-static struct ipt_acct_record *acct_pool, *dump_pool;
-static struct ipt_acct_record *free_record;
+/* The oldest pending generation is held by the reader, see
+   IPT_ACCT_HOLD_DUMP. read() and IPT_ACCT_GET_DUMP hold it as well while
+   copying it, so the copy needs no lock. READ_SEM serializes readers. */
+static int held_p;
+static DECLARE_MUTEX (read_sem);
+
+/* Every pool is mapped at a multiple of MAP_STRIDE bytes of the device
+   memory map. */
+static unsigned long map_stride;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 0)
+static struct address_space *map_mapping;
+#endif
+
+/* Size that pools and tables are being resized to. */
+static unsigned int target_size;
+
+/* CPUs online at load time, which share the records with percpu_p. It
+   is fixed so that every resize computes the same table capacity. */
+static unsigned int ncpus;
+static struct work_struct resize_work;
+
+static struct work_struct dump_work;
+
+/* Generations up to EXPORTED_SEQ have been multicast to NL_SOCK. */
+static struct sock *nl_sock;
+static struct work_struct export_work;
+static __u64 exported_seq;
+
+/* Retries the export while the reader holds read_sem. */
+static struct timer_list export_timer;
+
+/* Ring area: struct ipt_acct_ring on the first page, the tail on the
+   second, the only one the reader may write to, and records from the
+   third one on. The module keeps its own copies of the size and HEAD and
+   only publishes them, so that nothing the reader writes but the tail is
+   ever read back. Up to RING_FIRST records of the generation RING_SEQ
+   have been put into the ring, which goes on at index RING_POS. */
+static void *ring;
+static unsigned long ring_length;
+static unsigned int ring_size;
+static __u64 ring_head;
+static unsigned int ring_pos;
+static __u64 ring_seq;
+static unsigned int ring_first;
+
+/* Statistics page, mapped between the pools and the ring. */
+static struct ipt_acct_stat_page *stat_page;
+static DECLARE_MUTEX (resize_sem);
 
-static unsigned int ndump;
 static DECLARE_WAIT_QUEUE_HEAD (dump_wait);
 
-static struct item **layers;
-static unsigned int nlayers;
+/* Random seed of the flow hash, so that nobody can predict which flows
+   collide. */
+static u32 hash_seed;
 
-#define HASH(src,dst,sport,dport,proto,magic) \
-  (((src ^ dst) + ((sport << 16) | dport)) + proto + magic)
+/* The device may be opened many times, but only READER consumes dumps. */
+static struct file *reader;
 
-static int device_opened_p;
+/* The dump timer is armed at load and rearms itself, so the packet path
+   never touches it. */
 static struct timer_list dump_timer;
 
 #ifndef DEFINE_SPINLOCK
 #define DEFINE_SPINLOCK(x) spinlock_t x = SPIN_LOCK_UNLOCKED
 #endif
 
-static DEFINE_SPINLOCK (hash_table_lock);
 static DEFINE_SPINLOCK (dump_lock);
-static DEFINE_SPINLOCK (stat_lock);
 
-static __u64 startup_ts;
-static __u64 records_lost;
-static __u64 pkts_accted;
-static __u64 pkts_not_accted;
-static __u64 pkts_dropped;
+#if LINUX_VERSION_CODE < KERNEL_VERSION (2, 6, 10)
+static DEFINE_SPINLOCK (atomic_lock);
 
-static int
-dump_is_empty_p (void)
+static inline int
+ipt_acct_atomic_inc_return (atomic_t *v)
 {
   int result;
-  spin_lock_bh (&dump_lock);
-  result = (ndump == 0);
-  spin_unlock_bh (&dump_lock);
+  spin_lock (&atomic_lock);
+  atomic_inc (v);
+  result = atomic_read (v);
+  spin_unlock (&atomic_lock);
   return result;
 }
 
+# define atomic_inc_return(v) ipt_acct_atomic_inc_return (v)
+#endif
+
+/* Packet buffered by a CPU with BATCH. The hash byte of KEY is set only
+   when the packet is accounted. */
+struct ipt_acct_update
+{
+  struct slot key;
+  __u32 size;
+  __u64 ts;
+};
+
+/* Statistics are kept per CPU and summed up only when requested, so
+   that accounting CPUs never write to a shared cache line. */
+struct ipt_acct_cpu
+{
+  __u64 startup_ts;
+  __u64 records_lost;
+  __u64 pkts_accted;
+  __u64 pkts_not_accted;
+  __u64 pkts_dropped;
+  __u64 ndumps;
+  __u64 ndumps_inline;
+  /* Cached time in TS_HZ units and the jiffy it was taken at. */
+  __u64 ts;
+  unsigned long ts_jiffies;
+  /* Last flow accounted on the CPU. Consecutive packets mostly belong
+     to the same flow, so it is checked before the hash table. It is
+     valid while LAST_POOL is set, a dump forgets it. Packets of
+     the last flow are counted in LAST_NPKTS, LAST_SIZE and LAST_TS under
+     LOCK only, so that a heavy flow hit from many CPUs does not bounce
+     its record and the table lock between them. The deltas are folded
+     into the record when the CPU switches to another flow or on dump. */
+  spinlock_t lock;
+  struct slot last;
+  struct ipt_acct_pool *last_pool;
+  __u64 last_hits;
+  __u32 last_npkts;
+  __u32 last_size;
+  __u64 last_ts;
+  /* Packets buffered with BATCH, also under LOCK. */
+  struct ipt_acct_update *updates;
+  unsigned int nupdates;
+} ____cacheline_aligned;
+
+static struct ipt_acct_cpu cpus[NR_CPUS];
+
+#define cpu_table(i) (percpu_p ? &tables[i] : &tables[0])
+
+static struct timer_list flush_timer;
+static struct timer_list stat_timer;
+
+/* NPENDING and HELD_P are changed under dump_lock but read without it
+   where a stale value is harmless: a word is read atomically, and a dump
+   wakes readers up only after it has been made. */
+static int
+dump_is_empty_p (void)
+{
+  smp_rmb ();
+  return npending == 0;
+}
+
+/* No more generations could be dumped without losing one. */
+static inline int
+dump_is_full_p (void)
+{
+  return npending == ngenerations - 1 && (no_loss_p || held_p);
+}
+
+/* Number of records in the ring the reader has not taken yet. The tail
+   comes from user space and is not trusted: a tail ahead of HEAD or too
+   far behind it makes the ring look full. */
+static unsigned int
+ipt_acct_ring_unread (void)
+{
+  volatile struct ipt_acct_ring_tail *tail;
+  __u64 unread;
+
+  tail = (struct ipt_acct_ring_tail *) ((char *) ring + PAGE_SIZE);
+  unread = ring_head - tail->tail;
+
+  /* The reader is done with the records before the tail it has moved. */
+  smp_mb ();
+
+  return unread > ring_size ? ring_size : unread;
+}
+
+static inline struct ipt_acct_pool *
+ipt_acct_oldest_pool (void)
+{
+  return &pools[(acct_index + ngenerations - npending) % ngenerations];
+}
+
+static int
+ipt_acct_pool_free_p (struct ipt_acct_pool *pool)
+{
+  unsigned int i = (pool - pools + ngenerations - acct_index) % ngenerations;
+  return i != 0 && i < ngenerations - npending;
+}
+
 static void
-ipt_acct_dump_records (int from_timer_p)
+ipt_acct_describe_pool (struct ipt_acct_pool *pool,
+                        struct ipt_acct_generation *generation)
+{
+  generation->seq = pool->seq;
+  generation->start_ts = pool->start_ts;
+  generation->end_ts = pool->end_ts;
+  generation->offset = (__u64) (pool - pools) * map_stride;
+  generation->nrecords = pool->nrecords;
+  generation->ts_hz = ts_hz;
+}
+
+static unsigned int
+ipt_acct_table_capacity (unsigned int size)
+{
+  unsigned int capacity;
+
+  if (!percpu_p)
+    return size;
+
+  /* A table of a single CPU is allowed to take up to twice its fair share
+     of the records, so that an unbalanced load does not force dumps too
+     early. */
+  capacity = 2 * (size / ncpus) + 1;
+
+  return capacity > size ? size : capacity;
+}
+
+/* Grow pools after they have been filled up and shrink them after they
+   have been mostly idle for a whole generation. */
+static void
+ipt_acct_update_target_size (int from_timer_p, unsigned int used,
+                             unsigned int size)
+{
+  unsigned int target = target_size;
+
+  /* A single CPU table fills up while the pool is still mostly empty, so
+     only the timer may shrink the pool. */
+  if (!from_timer_p && size < max_records)
+    target = size > max_records / 2 ? max_records : 2 * size;
+  else if (from_timer_p && used < size / 8 && size > min_records)
+    target = size / 2 < min_records ? min_records : size / 2;
+
+  if (target != target_size)
+    {
+      target_size = target;
+      schedule_work (&resize_work);
+    }
+}
+
+/* Called with the table of the last flow of CPU locked. */
+static void
+ipt_acct_fold_last (struct ipt_acct_cpu *cpu)
+{
+  struct ipt_acct_record *record;
+
+  if (cpu->last_npkts == 0)
+    return;
+
+  record = &cpu->last_pool->records[cpu->last.record - 1];
+  record->npkts += cpu->last_npkts;
+  record->size += cpu->last_size;
+  if (record->last < cpu->last_ts)
+    record->last = cpu->last_ts;
+
+  cpu->last_npkts = 0;
+  cpu->last_size = 0;
+}
+
+static int ipt_acct_merge_updates (struct ipt_acct_cpu *cpu,
+                                   struct ipt_acct_table *table);
+
+/* Move TABLE from the pool being dumped to the acct pool. Packets
+   buffered by its CPUs go to the dumped pool first, as many as fit, and
+   the last flows of its CPUs are folded and forgotten, so that nothing
+   is accounted to the dumped pool afterwards. Called with dump_lock held,
+   takes the table lock and one CPU lock at a time. */
+static void
+ipt_acct_switch_table (struct ipt_acct_table *table)
 {
+  struct ipt_acct_cpu *cpu;
   unsigned int i;
-  struct ipt_acct_record *tmp;
-  struct item *tmp_item;
 
-  spin_lock_bh (&dump_lock);
+  spin_lock (&table->lock);
+
+  for (i = 0; i < NR_CPUS; ++i)
+    if (cpu_possible (i) && cpu_table (i) == table)
+      {
+        cpu = &cpus[i];
+        spin_lock (&cpu->lock);
+        if (cpu->nupdates != 0)
+          ipt_acct_merge_updates (cpu, table);
+        ipt_acct_fold_last (cpu);
+        cpu->last_pool = NULL;
+        spin_unlock (&cpu->lock);
+      }
 
-  if (ndump)
+  table->pool = acct_pool;
+
+  if (table->next_slots && !table->old_slots
+      && table->next_capacity == ipt_acct_table_capacity (acct_pool->size))
     {
-      if (no_loss_p)
-        {
-          spin_unlock_bh (&dump_lock);
-          return;
-        }
-      else
-        {
-          spin_lock_bh (&stat_lock);
-          records_lost += ndump;
-          spin_unlock_bh (&stat_lock);
-        }
+      table->old_slots = table->slots;
+      table->slots = table->next_slots;
+      table->mask = table->next_mask;
+      table->capacity = table->next_capacity;
+      table->next_slots = NULL;
+    }
+  else if (++table->gen == 0)
+    {
+      /* Stale slots would look used again after wrapping. */
+      memset (table->slots, 0, (table->mask + 1) * sizeof (struct slot));
+      table->gen = 1;
     }
+  table->nused = 0;
+
+  spin_unlock (&table->lock);
+}
+
+static void
+ipt_acct_dump_records (int from_timer_p)
+{
+  unsigned int n, i;
+  __u64 now;
+  struct ipt_acct_pool *pool;
+  struct ipt_acct_table *table;
+
+  /* Packets keep on trying to dump while the ring is full, they should
+     not contend with the reader for dump_lock meanwhile. */
+  smp_rmb ();
+  if (dump_is_full_p ())
+    return;
 
-  ndump = free_record - acct_pool;
+  spin_lock_bh (&dump_lock);
 
-  if (ndump == 0)
+  /* A held generation is being read in place and must not be lost. */
+  if (dump_is_full_p ())
     {
       spin_unlock_bh (&dump_lock);
       return;
     }
 
-  for (i = 0; i < nlayers; ++i)
-    layers[i] = NULL;
+  /* Buffered packets make records once merged. */
+  n = atomic_read (&acct_pool->nused);
+  for (i = 0; n == 0 && i < NR_CPUS; ++i)
+    if (cpu_possible (i))
+      n = cpus[i].nupdates;
+
+  if (n != 0)
+    {
+      if (npending == ngenerations - 1)
+        {
+          pool = ipt_acct_oldest_pool ();
+          cpus[smp_processor_id ()].records_lost += pool->nrecords;
+          npending -= 1;
+        }
+
+      now = get_seconds ();
+      pool = acct_pool;
+      acct_index = (acct_index + 1) % ngenerations;
+      acct_pool = &pools[acct_index];
+      acct_pool->seq = pool->seq + 1;
+      acct_pool->start_ts = now;
+      atomic_set (&acct_pool->nused, 0);
+
+      /* Tables are moved one by one, without nesting their locks. Records
+         still go to the dumped pool until its last table is moved. */
+      for_each_table (table)
+        ipt_acct_switch_table (table);
+
+      n = atomic_read (&pool->nused);
+      pool->nrecords = n;
+      pool->end_ts = now;
 
-  tmp_item = acct_item_pool;
-  acct_item_pool = dump_item_pool;
-  dump_item_pool = tmp_item;
-  free_item = &acct_item_pool[0];
+      cpus[smp_processor_id ()].ndumps += 1;
+      npending += 1;
 
-  tmp = acct_pool;
-  acct_pool = dump_pool;
-  dump_pool = tmp;
-  free_record = &acct_pool[0];
+      ipt_acct_update_target_size (from_timer_p, n, pool->size);
+    }
 
   spin_unlock_bh (&dump_lock);
 
-  wake_up (&dump_wait);
+  if (n != 0)
+    {
+      wake_up (&dump_wait);
+      if (nl_sock || ring)
+        schedule_work (&export_work);
+    }
+}
+
+static unsigned long
+ipt_acct_ms_to_jiffies (unsigned long ms)
+{
+  ms = ms / 1000 * HZ + (ms % 1000 * HZ + 999) / 1000;
+
+  return ms ? ms : 1;
+}
+
+/* Jiffies until the next periodic dump. */
+static unsigned long
+ipt_acct_dump_delay (void)
+{
+  unsigned long delay = interval_ms;
+
+  if (align_p)
+    {
+      struct timeval tv;
+      u64 now;
+
+      do_gettimeofday (&tv);
+      now = (u64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+      delay -= do_div (now, interval_ms);
+    }
+
+  return ipt_acct_ms_to_jiffies (delay);
 }
 
 static void
 ipt_acct_dump_timer (unsigned long data)
 {
-  spin_lock_bh (&hash_table_lock);
   ipt_acct_dump_records (1);
-  spin_unlock_bh (&hash_table_lock);
+  mod_timer (&dump_timer, jiffies + ipt_acct_dump_delay ());
+}
+
+/* PERCENT of SIZE without overflow. */
+static inline unsigned int
+ipt_acct_level (unsigned int size, unsigned int percent)
+{
+  return size / 100 * percent + size % 100 * percent / 100;
+}
+
+static inline unsigned int
+ipt_acct_watermark (unsigned int size)
+{
+  return ipt_acct_level (size, watermark);
+}
+
+/* The dump being accounted has reached the poll watermark and is not the
+   generation SEEN, the last one reported. */
+static inline int
+ipt_acct_pri_p (unsigned long seen)
+{
+  return (poll_watermark > 0 && seen != (unsigned long) acct_pool->seq
+          && atomic_read (&acct_pool->nused)
+             >= ipt_acct_level (acct_pool->size, poll_watermark));
+}
+
+/* Dump records that have reached the watermark. The dump could have
+   happened already while the work was queued. */
+static void
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 20)
+ipt_acct_dump_work (struct work_struct *work)
+#else
+ipt_acct_dump_work (void *data)
+#endif
+{
+  struct ipt_acct_table *table;
+  int dump_p;
+
+  spin_lock_bh (&dump_lock);
+  dump_p = (atomic_read (&acct_pool->nused)
+            >= ipt_acct_watermark (acct_pool->size));
+  spin_unlock_bh (&dump_lock);
+
+  for_each_table (table)
+    if (table->nused >= ipt_acct_watermark (table->capacity))
+      dump_p = 1;
+
+  if (dump_p)
+    ipt_acct_dump_records (0);
+  else if (ipt_acct_pri_p (0))
+    wake_up (&dump_wait);
+}
+
+/* The flow hash is always computed here. Kernels this module is built for
+   keep no flow hash in the skb, and taking one from conntrack would put
+   untracked packets of a flow into another slot than tracked ones. Flows
+   stay in the table of the receiving CPU with percpu_p. */
+static inline u32
+ipt_acct_hash (u32 src, u32 dst, u16 sport, u16 dport, u8 proto, u16 magic)
+{
+  u32 key[4];
+
+  key[0] = src;
+  key[1] = dst;
+  key[2] = ((u32) sport << 16) | dport;
+  key[3] = ((u32) proto << 16) | magic;
+
+  return jhash2 (key, 4, hash_seed);
+}
+
+/* Slots left from earlier generations are empty. */
+static inline int
+slot_empty_p (const struct ipt_acct_table *table, const struct slot *slot)
+{
+  return slot->gen != table->gen;
+}
+
+/* Returns either the slot of the flow KEY or the empty slot it should be
+   put in. */
+static inline struct slot *
+ipt_acct_lookup (struct ipt_acct_table *table, const struct slot *key,
+                 u32 hash)
+{
+  unsigned int i;
+  struct slot *slot;
+
+  for (i = hash & table->mask;; i = (i + 1) & table->mask)
+    {
+      slot = &table->slots[i];
+      if (slot_empty_p (table, slot)
+          || memcmp (slot, key, SLOT_KEY_SIZE) == 0)
+        return slot;
+    }
+}
+
+/* Coarse clock for flow timestamps. Packets arriving within the same
+   jiffy get the same time. */
+static inline __u64
+ipt_acct_now (struct ipt_acct_cpu *cpu)
+{
+  struct timeval tv;
+  unsigned long now = jiffies;
+
+  if (cpu->ts_jiffies == now && cpu->ts != 0)
+    return cpu->ts;
+
+  if (ts_hz == 1)
+    cpu->ts = get_seconds ();
+  else
+    {
+      do_gettimeofday (&tv);
+      cpu->ts = (__u64) tv.tv_sec * ts_hz
+                + (ts_hz >= 1000000 ? (__u64) tv.tv_usec * (ts_hz / 1000000)
+                                    : tv.tv_usec / (1000000 / ts_hz));
+    }
+
+  cpu->ts_jiffies = now;
+  return cpu->ts;
+}
+
+static int
+ipt_acct_new_record (struct ipt_acct_table *table, struct slot *slot,
+                     const struct slot *key, __u64 now)
+{
+  struct ipt_acct_record *record;
+  int n;
+
+  if (table->nused == table->capacity)
+    return 0;
+
+  n = atomic_inc_return (&table->pool->nused) - 1;
+
+  if (n >= table->pool->size)
+    {
+      atomic_dec (&table->pool->nused);
+      return 0;
+    }
+
+  memcpy (slot, key, SLOT_KEY_SIZE);
+  slot->record = n + 1;
+  slot->gen = table->gen;
+  table->nused += 1;
+
+  /* Exactly one packet crosses each watermark. Pollers are woken up by
+     the work as well. */
+  if (n + 1 == ipt_acct_watermark (table->pool->size)
+      || table->nused == ipt_acct_watermark (table->capacity)
+      || (poll_watermark > 0
+          && n + 1 == ipt_acct_level (table->pool->size, poll_watermark)))
+    schedule_work (&dump_work);
+
+  record = &table->pool->records[n];
+  record->src = key->src;
+  record->dst = key->dst;
+  record->sport = key->sport;
+  record->dport = key->dport;
+  record->proto = key->proto;
+  record->npkts = 0;
+  record->size = 0;
+  record->first = now;
+  record->magic = key->magic;
+  record->cpu = table - tables;
+  record->reserved = 0;
+
+  return 1;
+}
+
+/* Look the flow of KEY up in TABLE, which is locked, and allocate a record
+   for it if it is new. Returns NULL if there is no room even after a
+   dump. */
+static struct ipt_acct_record *
+ipt_acct_find_record (struct ipt_acct_table *table, struct ipt_acct_cpu *cpu,
+                      struct slot *key, __u64 now)
+{
+  struct slot *slot;
+  u32 hash;
+
+  hash = ipt_acct_hash (key->src, key->dst, key->sport, key->dport,
+                        key->proto, key->magic);
+  key->sig = hash >> 24;
+
+  slot = ipt_acct_lookup (table, key, hash);
+
+  if (slot_empty_p (table, slot)
+      && !ipt_acct_new_record (table, slot, key, now))
+    {
+      /* The deferred dump has not made it in time. */
+      spin_unlock_bh (&table->lock);
+      cpu->ndumps_inline += 1;
+      ipt_acct_dump_records (0);
+      spin_lock_bh (&table->lock);
+
+      /* Another CPU could have accounted the same flow meanwhile. */
+      slot = ipt_acct_lookup (table, key, hash);
+
+      if (slot_empty_p (table, slot)
+          && !ipt_acct_new_record (table, slot, key, now))
+        return NULL;
+    }
+
+  spin_lock (&cpu->lock);
+  ipt_acct_fold_last (cpu);
+  cpu->last = *slot;
+  cpu->last_pool = table->pool;
+  spin_unlock (&cpu->lock);
+
+  return &table->pool->records[slot->record - 1];
+}
+
+/* Account packets buffered by CPU. Called with the table of the CPU and
+   the lock of the CPU held. Returns 0 if the table has filled up, in
+   which case the rest stays buffered. */
+static int
+ipt_acct_merge_updates (struct ipt_acct_cpu *cpu, struct ipt_acct_table *table)
+{
+  struct ipt_acct_update *update;
+  struct ipt_acct_record *record;
+  struct slot *slot, *last = NULL;
+  unsigned int i;
+  u32 hash;
+
+  for (i = 0; i < cpu->nupdates; ++i)
+    {
+      update = &cpu->updates[i];
+      hash = ipt_acct_hash (update->key.src, update->key.dst,
+                            update->key.sport, update->key.dport,
+                            update->key.proto, update->key.magic);
+      update->key.sig = hash >> 24;
+
+      slot = ipt_acct_lookup (table, &update->key, hash);
+
+      if (slot_empty_p (table, slot)
+          && !ipt_acct_new_record (table, slot, &update->key, update->ts))
+        break;
+
+      record = &table->pool->records[slot->record - 1];
+      record->npkts += 1;
+      record->size += update->size;
+      if (record->last < update->ts)
+        record->last = update->ts;
+      last = slot;
+    }
+
+  if (i == 0)
+    return cpu->nupdates == 0;
+
+  /* Further packets of the flow accounted last are counted as deltas. */
+  ipt_acct_fold_last (cpu);
+  cpu->last = *last;
+  cpu->last_pool = table->pool;
+
+  cpu->nupdates -= i;
+  memmove (cpu->updates, cpu->updates + i,
+           cpu->nupdates * sizeof (struct ipt_acct_update));
+
+  return cpu->nupdates == 0;
+}
+
+static int
+ipt_acct_flush_updates (struct ipt_acct_cpu *cpu, struct ipt_acct_table *table)
+{
+  int result;
+
+  spin_lock_bh (&table->lock);
+  spin_lock (&cpu->lock);
+  result = ipt_acct_merge_updates (cpu, table);
+  spin_unlock (&cpu->lock);
+  spin_unlock_bh (&table->lock);
+
+  return result;
+}
+
+static void
+ipt_acct_flush_timer (unsigned long data)
+{
+  unsigned int i;
+
+  for (i = 0; i < NR_CPUS; ++i)
+    if (cpu_possible (i) && cpus[i].nupdates != 0
+        && !ipt_acct_flush_updates (&cpus[i], cpu_table (i)))
+      schedule_work (&dump_work);
+
+  mod_timer (&flush_timer, jiffies + ipt_acct_ms_to_jiffies (batch_ms));
 }
 
 static unsigned int
@@ -227,11 +984,14 @@ ipt_acct_handle (struct sk_buff **pskb, const struct net_device *in,
 #endif
                  )
 {
-  unsigned int i;
   struct sk_buff *skb = *pskb;
   struct ipt_acct_info *info = (struct ipt_acct_info *) target_info;
   struct iphdr tmp_iph, *ip_header;
-  struct item *item;
+  struct ipt_acct_table *table;
+  struct ipt_acct_cpu *cpu;
+  struct ipt_acct_record *record;
+  __u64 now;
+  struct slot key;
   u32 src, dst;
   u16 sport, dport;
   u16 size;
@@ -283,71 +1043,104 @@ ipt_acct_handle (struct sk_buff **pskb, const struct net_device *in,
 #endif
   }
 
-  i = HASH (src, dst, sport, dport, proto, info->magic) % nlayers;
+  /* Netfilter runs targets with bottom halves disabled, so we cannot
+     migrate to another CPU here. */
+  cpu = &cpus[smp_processor_id ()];
+  now = ipt_acct_now (cpu);
+  table = cpu_table (smp_processor_id ());
+
+  key.src = src;
+  key.dst = dst;
+  key.sport = sport;
+  key.dport = dport;
+  key.magic = info->magic;
+  key.proto = proto;
+
+  spin_lock_bh (&cpu->lock);
+
+  if (cpu->last_pool && memcmp (&cpu->last, &key, SLOT_FLOW_SIZE) == 0)
+    {
+      cpu->last_hits += 1;
+      cpu->last_npkts += 1;
+      cpu->last_size += size;
+      cpu->last_ts = now;
 
-  spin_lock_bh (&hash_table_lock);
+      if (cpu->pkts_accted == 0)
+        cpu->startup_ts = get_seconds ();
+      cpu->pkts_accted += 1;
 
-  for (item = layers[i]; item; item = item->next)
-    if (item->record->src == src && item->record->dst == dst
-        && item->record->sport == sport && item->record->dport == dport
-        && item->record->proto == proto && item->record->magic == info->magic)
-      break;
+      spin_unlock_bh (&cpu->lock);
+      return info->retcode;
+    }
 
-  if (!item)
+  if (batch)
     {
-      if (!free_item)
-        ipt_acct_dump_records (0);
+      struct ipt_acct_update *update;
 
-      if (!free_item)
+      if (cpu->nupdates == batch)
         {
-	  spin_lock_bh (&stat_lock);
-	  if (info->critical_p)
-	    pkts_not_accted += 1;
-	  else
-	    pkts_dropped += 1;
-	  spin_unlock_bh (&stat_lock);
-          spin_unlock_bh (&hash_table_lock);
-          return info->critical_p ? info->retcode : NF_DROP;
+          spin_unlock_bh (&cpu->lock);
+
+          /* The dump accounts the buffer as well. */
+          if (!ipt_acct_flush_updates (cpu, table))
+            {
+              cpu->ndumps_inline += 1;
+              ipt_acct_dump_records (0);
+            }
+
+          spin_lock_bh (&cpu->lock);
         }
 
-      item = free_item;
-      item->record = free_record;
+      if (cpu->nupdates == batch)
+        {
+          if (info->critical_p)
+            cpu->pkts_not_accted += 1;
+          else
+            cpu->pkts_dropped += 1;
+          spin_unlock_bh (&cpu->lock);
+          return info->critical_p ? info->retcode : NF_DROP;
+        }
 
-      if (++free_item == acct_item_pool + max_records)
-        free_item = NULL;
+      update = &cpu->updates[cpu->nupdates++];
+      update->key = key;
+      update->size = size;
+      update->ts = now;
 
-      ++free_record;
+      if (cpu->pkts_accted == 0)
+        cpu->startup_ts = get_seconds ();
+      cpu->pkts_accted += 1;
 
-      item->next = layers[i];
-      layers[i] = item;
-      item->record->src = src;
-      item->record->dst = dst;
-      item->record->sport = sport;
-      item->record->dport = dport;
-      item->record->proto = proto;
-      item->record->npkts = 0;
-      item->record->size = 0;
-      item->record->first = get_seconds ();
-      item->record->magic = info->magic;
+      spin_unlock_bh (&cpu->lock);
+      return info->retcode;
     }
 
-  item->record->npkts += 1;
-  item->record->size += size;
-  item->record->last = get_seconds ();
+  spin_unlock_bh (&cpu->lock);
 
-  spin_lock_bh (&stat_lock);
-  if (pkts_accted == 0)
-    startup_ts = item->record->last;
-  pkts_accted += 1;
-  spin_unlock_bh (&stat_lock);
+  spin_lock_bh (&table->lock);
+  record = ipt_acct_find_record (table, cpu, &key, now);
 
-  if (timeout > 0 && !timer_pending (&dump_timer))
+  if (!record)
     {
-      dump_timer.expires = jiffies + timeout * HZ;
-      add_timer (&dump_timer);
+      if (info->critical_p)
+        cpu->pkts_not_accted += 1;
+      else
+        cpu->pkts_dropped += 1;
+      spin_unlock_bh (&table->lock);
+      return info->critical_p ? info->retcode : NF_DROP;
     }
-  
-  spin_unlock_bh (&hash_table_lock);
+
+  record->npkts += 1;
+  record->size += size;
+  /* Deltas folded in by another CPU may carry a later stamp. */
+  if (record->last < now)
+    record->last = now;
+
+  if (cpu->pkts_accted == 0)
+    cpu->startup_ts = get_seconds ();
+  cpu->pkts_accted += 1;
+
+  spin_unlock_bh (&table->lock);
+
   return info->retcode;
 }
 
@@ -388,65 +1181,750 @@ ipt_acct_check_entry (const char *table_name, const struct ipt_entry *entry,
   return 1;
 }
 
-static int
-ipt_acct_open_device (struct inode *inode, struct file *file)
+static void
+ipt_acct_get_stat (struct ipt_acct_stat *stat)
 {
-  if (device_opened_p)
-    return -EBUSY;
-  device_opened_p = 1;
-  try_module_get (THIS_MODULE);
-  return 0;
-}
+  unsigned int i;
+  struct ipt_acct_table *table;
 
-unsigned int
-ipt_acct_poll_device (struct file *file, struct poll_table_struct *pt)
-{
-  if (!dump_is_empty_p ())
-    return POLLIN | POLLRDNORM;
-  poll_wait (file, &dump_wait, pt);
-  return dump_is_empty_p () ? 0 : POLLIN | POLLRDNORM;
-}
+  memset (stat, 0, sizeof (*stat));
 
-static int
-ipt_acct_ioctl_device (struct inode *inode, struct file *file,
-                       unsigned int cmd, unsigned long data)
+  for_each_table (table)
+    stat->nbuckets += table->mask + 1;
+  stat->nflows = atomic_read (&acct_pool->nused);
+  stat->capacity = acct_pool->size;
+
+  for (i = 0; i < NR_CPUS; ++i)
+    {
+      if (cpus[i].startup_ts != 0
+          && (stat->startup_ts == 0 || cpus[i].startup_ts < stat->startup_ts))
+        stat->startup_ts = cpus[i].startup_ts;
+      stat->records_lost += cpus[i].records_lost;
+      stat->pkts_accted += cpus[i].pkts_accted;
+      stat->pkts_not_accted += cpus[i].pkts_not_accted;
+      stat->pkts_dropped += cpus[i].pkts_dropped;
+      stat->ndumps += cpus[i].ndumps;
+      stat->ndumps_inline += cpus[i].ndumps_inline;
+      stat->last_hits += cpus[i].last_hits;
+    }
+}
+
+/* Refresh the statistics page. SEQ is odd while the page is written, the
+   timer being the only writer. */
+static void
+ipt_acct_stat_timer (unsigned long data)
+{
+  stat_page->seq++;
+  smp_wmb ();
+
+  ipt_acct_get_stat (&stat_page->stat);
+  stat_page->generation = acct_pool->seq;
+  stat_page->npending = npending;
+  stat_page->ngenerations = ngenerations;
+
+  smp_wmb ();
+  stat_page->seq++;
+
+  mod_timer (&stat_timer, jiffies + ipt_acct_ms_to_jiffies (stat_ms));
+}
+
+static int
+ipt_acct_open_device (struct inode *inode, struct file *file)
+{
+  if (!try_module_get (THIS_MODULE))
+    return -ENODEV;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 8)
+  /* The file position is the place of the reader in the dump, which only
+     read() and splice() move. */
+  nonseekable_open (inode, file);
+#endif
+  return 0;
+}
+
+/* Take read_sem for FILE. The first opener to consume a dump becomes the
+   reader until it closes the device, others may only look at statistics,
+   generations and copies of pending records. */
+static int
+ipt_acct_lock_reader (struct file *file)
+{
+  if (down_interruptible (&read_sem))
+    return -ERESTARTSYS;
+
+  if (!reader)
+    reader = file;
+
+  if (reader != file)
+    {
+      up (&read_sem);
+      return -EBUSY;
+    }
+
+  return 0;
+}
+
+unsigned int
+ipt_acct_poll_device (struct file *file, struct poll_table_struct *pt)
+{
+  unsigned int mask = 0;
+
+  /* The reader may have made room in the ring for generations left
+     behind. */
+  if (ring && !dump_is_empty_p ())
+    schedule_work (&export_work);
+
+  poll_wait (file, &dump_wait, pt);
+
+  if (ring ? ipt_acct_ring_unread () != 0 : !dump_is_empty_p ())
+    mask |= POLLIN | POLLRDNORM;
+
+  /* POLLPRI is reported once per generation to each file, which keeps
+     the last generation reported in private_data. A collector waiting for
+     the dump timer does not spin then, and nobody polling another file
+     takes the report from it. Generations start at one. */
+  if (ipt_acct_pri_p ((unsigned long) file->private_data))
+    {
+      spin_lock_bh (&dump_lock);
+      if (ipt_acct_pri_p ((unsigned long) file->private_data))
+        {
+          file->private_data = (void *) (unsigned long) acct_pool->seq;
+          mask |= POLLPRI;
+        }
+      spin_unlock_bh (&dump_lock);
+    }
+
+  return mask;
+}
+
+/* Hand the oldest generation, having been read, back to the ring. Called
+   with dump_lock and read_sem held. */
+static void
+ipt_acct_release_oldest (struct file *file)
+{
+  struct ipt_acct_pool *pool = ipt_acct_oldest_pool ();
+
+  ipt_acct_describe_pool (pool, &last_generation);
+  held_p = 0;
+  npending -= 1;
+  if (file)
+    file->f_pos = 0;
+
+  /* The pool is free now and could be resized. */
+  if (pool->size != target_size)
+    schedule_work (&resize_work);
+}
+
+static void
+ipt_acct_nl_send (int type, __u32 seq, const void *data, unsigned int size)
+{
+  struct sk_buff *skb;
+  struct nlmsghdr *nlh;
+
+  skb = alloc_skb (NLMSG_SPACE (size), GFP_KERNEL);
+
+  if (!skb)
+    return;
+
+  nlh = (struct nlmsghdr *) skb_put (skb, NLMSG_SPACE (size));
+  nlh->nlmsg_len = NLMSG_LENGTH (size);
+  nlh->nlmsg_type = type;
+  nlh->nlmsg_flags = NLM_F_MULTI;
+  nlh->nlmsg_seq = seq;
+  nlh->nlmsg_pid = 0;
+  memcpy (NLMSG_DATA (nlh), data, size);
+  memset ((char *) NLMSG_DATA (nlh) + size, 0,
+          NLMSG_SPACE (size) - NLMSG_LENGTH (size));
+
+  /* Group 1 is the same as the group mask of old kernels. */
+  netlink_broadcast (nl_sock, skb, 0, IPT_ACCT_NLGRP, GFP_KERNEL);
+}
+
+/* Multicast every pending generation that has not been exported yet: its
+   description, its records as many to a message as fit, and NLMSG_DONE.
+   The export acts as a reader, so unless the device has one or the ring
+   takes them, exported generations are released. Called with read_sem
+   held. */
+static void
+ipt_acct_export_netlink (void)
+{
+  struct ipt_acct_generation generation;
+  struct ipt_acct_pool *pool;
+  unsigned int i, first, n, max_n;
+  int held_before_p;
+
+  max_n = (NLMSG_GOODSIZE - NLMSG_LENGTH (0))
+          / sizeof (struct ipt_acct_record);
+
+  while (1)
+    {
+      spin_lock_bh (&dump_lock);
+
+      for (i = npending; i > 0; --i)
+        {
+          pool = &pools[(acct_index + ngenerations - i) % ngenerations];
+          if (pool->seq > exported_seq)
+            break;
+        }
+
+      if (i == 0)
+        {
+          spin_unlock_bh (&dump_lock);
+          break;
+        }
+
+      /* No generation is dropped while the export goes on. */
+      held_before_p = held_p;
+      held_p = 1;
+      ipt_acct_describe_pool (pool, &generation);
+      spin_unlock_bh (&dump_lock);
+
+      ipt_acct_nl_send (IPT_ACCT_NLMSG_GENERATION, generation.seq,
+                        &generation, sizeof (generation));
+
+      for (first = 0; first < generation.nrecords; first += n)
+        {
+          n = min (max_n, generation.nrecords - first);
+          ipt_acct_nl_send (IPT_ACCT_NLMSG_RECORDS, generation.seq,
+                            pool->records + first,
+                            n * sizeof (struct ipt_acct_record));
+        }
+
+      ipt_acct_nl_send (NLMSG_DONE, generation.seq, NULL, 0);
+
+      spin_lock_bh (&dump_lock);
+      held_p = held_before_p;
+      exported_seq = generation.seq;
+
+      while (!reader && !ring && npending > 0
+             && ipt_acct_oldest_pool ()->seq <= exported_seq)
+        ipt_acct_release_oldest (NULL);
+
+      spin_unlock_bh (&dump_lock);
+    }
+}
+
+/* Put up to N records into the ring, returns how many have fit. */
+static unsigned int
+ipt_acct_ring_put (const struct ipt_acct_record *records, unsigned int n)
+{
+  struct ipt_acct_ring *header = ring;
+  struct ipt_acct_record *slots;
+  unsigned int chunk;
+
+  slots = (struct ipt_acct_record *) ((char *) ring + 2 * PAGE_SIZE);
+  n = min (n, ring_size - ipt_acct_ring_unread ());
+  chunk = min (n, ring_size - ring_pos);
+
+  memcpy (slots + ring_pos, records, chunk * sizeof (struct ipt_acct_record));
+  memcpy (slots, records + chunk,
+          (n - chunk) * sizeof (struct ipt_acct_record));
+  ring_pos = (ring_pos + n) % ring_size;
+  ring_head += n;
+
+  /* Records are written before the reader sees them in HEAD. */
+  smp_wmb ();
+  header->head = ring_head;
+
+  return n;
+}
+
+/* Put pending generations into the ring, the oldest first, and release
+   each one as soon as all its records are in. When the ring is full the
+   rest waits until the reader polls again. Records only come with dumps,
+   so the reader is woken up once per export. Called with read_sem
+   held. */
+static void
+ipt_acct_export_ring (void)
+{
+  struct ipt_acct_pool *pool;
+  unsigned int nrecords, n, nput = 0;
+  int held_before_p;
+
+  while (1)
+    {
+      spin_lock_bh (&dump_lock);
+
+      if (npending == 0)
+        {
+          spin_unlock_bh (&dump_lock);
+          break;
+        }
+
+      pool = ipt_acct_oldest_pool ();
+      nrecords = pool->nrecords;
+      if (pool->seq != ring_seq)
+        {
+          ring_seq = pool->seq;
+          ring_first = 0;
+        }
+      held_before_p = held_p;
+      held_p = 1;
+      spin_unlock_bh (&dump_lock);
+
+      n = ipt_acct_ring_put (pool->records + ring_first,
+                             nrecords - ring_first);
+      ring_first += n;
+      nput += n;
+
+      spin_lock_bh (&dump_lock);
+      held_p = held_before_p;
+      if (ring_first == nrecords)
+        ipt_acct_release_oldest (NULL);
+      spin_unlock_bh (&dump_lock);
+
+      if (ring_first < nrecords)
+        break;
+    }
+
+  if (nput != 0)
+    wake_up (&dump_wait);
+}
+
+/* The reader holds read_sem while copying to user space, which may sleep
+   for long, and the shared workqueue must not wait for it. The export is
+   retried from export_timer then. */
+static void
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 20)
+ipt_acct_export_work (struct work_struct *work)
+#else
+ipt_acct_export_work (void *data)
+#endif
+{
+  if (down_trylock (&read_sem))
+    {
+      mod_timer (&export_timer, jiffies + 1);
+      return;
+    }
+
+  if (nl_sock)
+    ipt_acct_export_netlink ();
+
+  if (ring)
+    ipt_acct_export_ring ();
+
+  up (&read_sem);
+}
+
+static void
+ipt_acct_export_timer (unsigned long data)
+{
+  schedule_work (&export_work);
+}
+
+static void
+ipt_acct_release_netlink (void)
+{
+  if (!nl_sock)
+    return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 24)
+  netlink_kernel_release (nl_sock);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 0)
+  sock_release (nl_sock->sk_socket);
+#else
+  sock_release (nl_sock->socket);
+#endif
+  nl_sock = NULL;
+}
+
+/* Find the records the reader is at, from *PPOS on in the oldest dump,
+   and hold the dump. Waits for a dump unless NONBLOCK_P. Returns how many
+   of at most N records there are with read_sem held, or zero once the
+   dump has been read through and is released, or an error. */
+static int
+ipt_acct_next_records (struct file *file, loff_t *ppos, unsigned int n,
+                       int nonblock_p, struct ipt_acct_record **records)
+{
+  struct ipt_acct_pool *pool;
+  u64 first;
+  int result;
+
+  result = ipt_acct_lock_reader (file);
+
+  if (result != 0)
+    return result;
+
+  spin_lock_bh (&dump_lock);
+
+  while (npending == 0)
+    {
+      spin_unlock_bh (&dump_lock);
+      up (&read_sem);
+
+      if (nonblock_p)
+        return -EAGAIN;
+
+      if (wait_event_interruptible (dump_wait, !dump_is_empty_p ()))
+        return -ERESTARTSYS;
+
+      if (down_interruptible (&read_sem))
+        return -ERESTARTSYS;
+
+      spin_lock_bh (&dump_lock);
+    }
+
+  pool = ipt_acct_oldest_pool ();
+  /* A 64 bit division would need libgcc on 32 bit machines. */
+  first = *ppos;
+  do_div (first, sizeof (struct ipt_acct_record));
+
+  if (first >= pool->nrecords)
+    {
+      ipt_acct_release_oldest (file);
+      *ppos = 0;
+      spin_unlock_bh (&dump_lock);
+      up (&read_sem);
+      return 0;
+    }
+
+  /* The held pool is neither dropped nor resized, so it is copied without
+     the lock. */
+  held_p = 1;
+  if (n > pool->nrecords - first)
+    n = pool->nrecords - first;
+  *records = pool->records + first;
+  spin_unlock_bh (&dump_lock);
+
+  return n;
+}
+
+static ssize_t
+ipt_acct_read_device (struct file *file, char *buf, size_t count,
+                      loff_t *ppos)
+{
+  struct ipt_acct_record *records;
+  int result, n;
+
+  n = count / sizeof (struct ipt_acct_record);
+
+  /* Records go through the ring then. */
+  if (n == 0 || ring)
+    return -EINVAL;
+
+  n = ipt_acct_next_records (file, ppos, n, file->f_flags & O_NONBLOCK,
+                             &records);
+
+  if (n <= 0)
+    return n;
+
+  if (copy_to_user (buf, records, n * sizeof (struct ipt_acct_record)))
+    result = -EFAULT;
+  else
+    {
+      *ppos += n * sizeof (struct ipt_acct_record);
+      result = n * sizeof (struct ipt_acct_record);
+    }
+
+  up (&read_sem);
+  return result;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 22)
+/* Whole records fitting in a page handed to a pipe. */
+#define SPLICE_PAGE_RECORDS \
+  (PAGE_SIZE / sizeof (struct ipt_acct_record))
+
+static void
+ipt_acct_pipe_buf_release (struct pipe_inode_info *pipe,
+                           struct pipe_buffer *buf)
+{
+  put_page (buf->page);
+}
+
+static struct pipe_buf_operations ipt_acct_pipe_buf_ops =
+{
+  .can_merge = 0,
+  .map = generic_pipe_buf_map,
+  .unmap = generic_pipe_buf_unmap,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 24)
+  .confirm = generic_pipe_buf_confirm,
+#else
+  .pin = generic_pipe_buf_pin,
+#endif
+  .release = ipt_acct_pipe_buf_release,
+  .steal = generic_pipe_buf_steal,
+  .get = generic_pipe_buf_get
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 23)
+static void
+ipt_acct_splice_release (struct splice_pipe_desc *spd, unsigned int i)
+{
+  put_page (spd->pages[i]);
+}
+#endif
+
+/* Like read(), but the records are copied into pages of their own that
+   go into the pipe and from there into a file or a socket. The pool
+   itself is not spliced: it is reused by later dumps while the pipe may
+   still hold its pages. */
+static ssize_t
+ipt_acct_splice_read_device (struct file *file, loff_t *ppos,
+                             struct pipe_inode_info *pipe, size_t len,
+                             unsigned int flags)
+{
+  struct page *pages[PIPE_BUFFERS];
+  struct partial_page partial[PIPE_BUFFERS];
+  struct splice_pipe_desc spd =
+  {
+    .pages = pages,
+    .partial = partial,
+    .flags = flags,
+    .ops = &ipt_acct_pipe_buf_ops,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 23)
+    .spd_release = ipt_acct_splice_release
+#endif
+  };
+  struct ipt_acct_record *records;
+  unsigned int i, chunk;
+  ssize_t result;
+  int n;
+
+  /* Pages are filled with whole records only, so a pipe takes whole
+     records too. */
+  n = min_t (size_t, len / sizeof (struct ipt_acct_record),
+             PIPE_BUFFERS * SPLICE_PAGE_RECORDS);
+
+  if (n == 0 || ring)
+    return -EINVAL;
+
+  n = ipt_acct_next_records (file, ppos, n,
+                             (file->f_flags & O_NONBLOCK)
+                             || (flags & SPLICE_F_NONBLOCK),
+                             &records);
+
+  if (n <= 0)
+    return n;
+
+  for (i = 0; n > 0; ++i, n -= chunk, records += chunk)
+    {
+      chunk = min_t (unsigned int, n, SPLICE_PAGE_RECORDS);
+      pages[i] = alloc_page (GFP_KERNEL);
+
+      if (!pages[i])
+        break;
+
+      memcpy (page_address (pages[i]), records,
+              chunk * sizeof (struct ipt_acct_record));
+      partial[i].offset = 0;
+      partial[i].len = chunk * sizeof (struct ipt_acct_record);
+    }
+
+  spd.nr_pages = i;
+  up (&read_sem);
+
+  if (i == 0)
+    return -ENOMEM;
+
+  /* The pipe may block, so the position moves on only afterwards. */
+  result = splice_to_pipe (pipe, &spd);
+
+  if (result > 0)
+    *ppos += result;
+
+  return result;
+}
+#endif
+
+/* Runs without the big kernel lock on kernels with unlocked_ioctl. Dump
+   retrieval is serialized by read_sem, statistics are read with no lock
+   at all. */
+static long
+ipt_acct_ioctl_device (struct file *file, unsigned int cmd,
+                       unsigned long data)
 {
   unsigned int tmp;
+  int error;
   struct ipt_acct_stat stat;
+  struct ipt_acct_generation generation;
+  struct ipt_acct_dump_range range;
+  struct ipt_acct_ring_info ring_info;
+  __u64 offset;
+  struct ipt_acct_pool *pool;
+
+  /* Dumps go through the ring then, which releases them on its own. */
+  if (ring && (cmd == IPT_ACCT_GET_DUMP || cmd == IPT_ACCT_HOLD_DUMP))
+    return -EBUSY;
 
   switch (cmd)
     {
     case IPT_ACCT_GET_MAX:
       return max_records;
     case IPT_ACCT_DUMP:
-      if (timeout)
+      /* With a dump interval only a dump past the poll watermark is made
+         ahead of the timer. */
+      if (interval_ms
+          && (poll_watermark == 0
+              || atomic_read (&acct_pool->nused)
+                 < ipt_acct_level (acct_pool->size, poll_watermark)))
         return 0;
       if (!dump_is_empty_p ())
         return 0;
-      ipt_acct_dump_timer (0);
+      ipt_acct_dump_records (1);
       return 0;
     case IPT_ACCT_GET_DUMP:
+      error = ipt_acct_lock_reader (file);
+
+      if (error != 0)
+        return error;
+
       spin_lock_bh (&dump_lock);
 
-      if (copy_to_user ((struct ipt_acct_record *) data, dump_pool,
-                        ndump * sizeof (struct ipt_acct_record)))
+      if (npending == 0 || held_p)
+        {
+          tmp = npending;
+          spin_unlock_bh (&dump_lock);
+          up (&read_sem);
+          return tmp == 0 ? 0 : -EBUSY;
+        }
+
+      /* Detach the generation, so that it is copied with no lock held. */
+      held_p = 1;
+      pool = ipt_acct_oldest_pool ();
+      tmp = pool->nrecords;
+      spin_unlock_bh (&dump_lock);
+
+      if (copy_to_user ((struct ipt_acct_record *) data, pool->records,
+                        tmp * sizeof (struct ipt_acct_record)))
         {
+          spin_lock_bh (&dump_lock);
+          held_p = 0;
           spin_unlock_bh (&dump_lock);
+          up (&read_sem);
           return -EFAULT;
         }
 
-      tmp = ndump;
-      ndump = 0;
+      spin_lock_bh (&dump_lock);
+      ipt_acct_release_oldest (file);
       spin_unlock_bh (&dump_lock);
+      up (&read_sem);
       return tmp;
+    case IPT_ACCT_GET_DUMP_RANGE:
+      if (copy_from_user (&range, (struct ipt_acct_dump_range *) data,
+                          sizeof (range)))
+        return -EFAULT;
+
+      /* The reader copies from the generation it holds. Other openers
+         copy from the oldest pending one without taking it: pending pools
+         are released only with read_sem held and never resized. */
+      if (down_interruptible (&read_sem))
+        return -ERESTARTSYS;
+
+      if (reader == file && ring)
+        {
+          up (&read_sem);
+          return -EBUSY;
+        }
+
+      spin_lock_bh (&dump_lock);
+
+      if (reader == file ? !held_p : npending == 0)
+        {
+          spin_unlock_bh (&dump_lock);
+          up (&read_sem);
+          return reader == file ? -EINVAL : 0;
+        }
+
+      pool = ipt_acct_oldest_pool ();
+      tmp = 0;
+      if (range.first < pool->nrecords)
+        tmp = min (range.count, pool->nrecords - range.first);
+      spin_unlock_bh (&dump_lock);
+
+      if (copy_to_user ((struct ipt_acct_record *) (unsigned long)
+                        range.records, pool->records + range.first,
+                        tmp * sizeof (struct ipt_acct_record)))
+        {
+          up (&read_sem);
+          return -EFAULT;
+        }
+
+      up (&read_sem);
+      return tmp;
+    case IPT_ACCT_GET_GENERATION:
+      spin_lock_bh (&dump_lock);
+      generation = last_generation;
+      spin_unlock_bh (&dump_lock);
+
+      if (copy_to_user ((struct ipt_acct_generation *) data, &generation,
+                        sizeof (generation)))
+        return -EFAULT;
+
+      return 0;
+    case IPT_ACCT_HOLD_DUMP:
+      error = ipt_acct_lock_reader (file);
+
+      if (error != 0)
+        return error;
+
+      spin_lock_bh (&dump_lock);
+
+      if (npending == 0)
+        {
+          spin_unlock_bh (&dump_lock);
+          up (&read_sem);
+          return -EAGAIN;
+        }
+
+      held_p = 1;
+      ipt_acct_describe_pool (ipt_acct_oldest_pool (), &generation);
+      spin_unlock_bh (&dump_lock);
+      up (&read_sem);
+
+      if (copy_to_user ((struct ipt_acct_generation *) data, &generation,
+                        sizeof (generation)))
+        return -EFAULT;
+
+      return 0;
+    case IPT_ACCT_RELEASE_DUMP:
+      error = ipt_acct_lock_reader (file);
+
+      if (error != 0)
+        return error;
+
+      spin_lock_bh (&dump_lock);
+
+      if (!held_p)
+        {
+          spin_unlock_bh (&dump_lock);
+          up (&read_sem);
+          return -EINVAL;
+        }
+
+      ipt_acct_release_oldest (file);
+      spin_unlock_bh (&dump_lock);
+      up (&read_sem);
+      return 0;
+    case IPT_ACCT_GET_RING:
+      if (!ring)
+        return -EINVAL;
+
+      /* Mapping the ring makes one the reader. */
+      error = ipt_acct_lock_reader (file);
+
+      if (error != 0)
+        return error;
+
+      up (&read_sem);
+      ring_info.offset = (__u64) ngenerations * map_stride + PAGE_SIZE;
+      ring_info.length = ring_length;
+
+      if (copy_to_user ((struct ipt_acct_ring_info *) data, &ring_info,
+                        sizeof (ring_info)))
+        return -EFAULT;
+
+      return 0;
+    case IPT_ACCT_GET_STAT_PAGE:
+      if (!stat_page)
+        return -EINVAL;
+
+      offset = (__u64) ngenerations * map_stride;
+
+      if (copy_to_user ((__u64 *) data, &offset, sizeof (offset)))
+        return -EFAULT;
+
+      return 0;
     case IPT_ACCT_GET_STAT:
-      spin_lock_bh (&stat_lock);
-      stat.startup_ts = startup_ts;
-      stat.records_lost = records_lost;
-      stat.pkts_accted = pkts_accted;
-      stat.pkts_not_accted = pkts_not_accted;
-      stat.pkts_dropped = pkts_dropped;
-      spin_unlock_bh (&stat_lock);
+      ipt_acct_get_stat (&stat);
 
       if (copy_to_user ((struct ipt_acct_stat *) data, &stat, sizeof (stat)))
         return -EFAULT;
@@ -457,10 +1935,141 @@ ipt_acct_ioctl_device (struct inode *inode, struct file *file,
   return -EINVAL;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 11)
+# ifdef CONFIG_COMPAT
+/* Commands of 32-bit collectors carry the size of a 32-bit pointer. */
+static long
+ipt_acct_compat_ioctl_device (struct file *file, unsigned int cmd,
+                              unsigned long data)
+{
+  if (_IOC_SIZE (cmd) == sizeof (compat_uptr_t))
+    cmd = _IOC (_IOC_DIR (cmd), _IOC_TYPE (cmd), _IOC_NR (cmd),
+                sizeof (void *));
+
+  return ipt_acct_ioctl_device (file, cmd,
+                                (unsigned long) compat_ptr (data));
+}
+# endif
+#else
+static int
+ipt_acct_locked_ioctl_device (struct inode *inode, struct file *file,
+                              unsigned int cmd, unsigned long data)
+{
+  return ipt_acct_ioctl_device (file, cmd, data);
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 0)
+static struct page *
+ipt_acct_nopage (struct vm_area_struct *vma, unsigned long address,
+                 int *type)
+{
+  struct ipt_acct_pool *pool;
+  struct page *page = NOPAGE_SIGBUS;
+  unsigned long pgoff, stride_pages;
+
+  stride_pages = map_stride >> PAGE_SHIFT;
+  pgoff = vma->vm_pgoff + ((address - vma->vm_start) >> PAGE_SHIFT);
+
+  /* The statistics page and the ring follow the pools and are never
+     replaced. */
+  if (pgoff / stride_pages >= ngenerations)
+    {
+      pgoff -= ngenerations * stride_pages;
+
+      if (pgoff == 0)
+        {
+          if (!stat_page)
+            return NOPAGE_SIGBUS;
+
+          page = virt_to_page (stat_page);
+        }
+      else if (!ring || ((pgoff - 1) << PAGE_SHIFT) >= ring_length)
+        return NOPAGE_SIGBUS;
+      else
+        page = vmalloc_to_page ((char *) ring + ((pgoff - 1) << PAGE_SHIFT));
+
+      get_page (page);
+
+      if (type)
+        *type = VM_FAULT_MINOR;
+
+      return page;
+    }
+
+  pool = &pools[pgoff / stride_pages];
+  pgoff %= stride_pages;
+
+  /* Pools are replaced under dump_lock when resized. Only records of
+     dumped generations are mapped. */
+  spin_lock_bh (&dump_lock);
+  if (pool != acct_pool && !ipt_acct_pool_free_p (pool)
+      && (pgoff << PAGE_SHIFT)
+         < pool->nrecords * sizeof (struct ipt_acct_record))
+    {
+      page = vmalloc_to_page ((char *) pool->records + (pgoff << PAGE_SHIFT));
+      get_page (page);
+    }
+  spin_unlock_bh (&dump_lock);
+
+  if (type && page != NOPAGE_SIGBUS)
+    *type = VM_FAULT_MINOR;
+
+  return page;
+}
+
+static struct vm_operations_struct ipt_acct_vm_ops =
+{
+  .nopage = ipt_acct_nopage
+};
+
+static int
+ipt_acct_mmap_device (struct file *file, struct vm_area_struct *vma)
+{
+  unsigned long stat_pgoff = ngenerations * (map_stride >> PAGE_SHIFT);
+  int tail_p;
+
+  /* Anybody may map the statistics page alone, the rest is the reader's. */
+  if (file != reader
+      && (vma->vm_pgoff != stat_pgoff
+          || vma->vm_end - vma->vm_start != PAGE_SIZE))
+    return -EBUSY;
+
+  /* Only the tail of the ring is writable, and only mapped alone, so that
+     the reader can advance it. The statistics page and the ring header
+     come before it. */
+  tail_p = (vma->vm_pgoff == stat_pgoff + 2
+            && vma->vm_end - vma->vm_start == PAGE_SIZE);
+
+  if (!tail_p)
+    {
+      if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+      vma->vm_flags &= ~VM_MAYWRITE;
+    }
+
+  vma->vm_flags |= VM_RESERVED;
+  vma->vm_ops = &ipt_acct_vm_ops;
+  map_mapping = file->f_mapping;
+
+  return 0;
+}
+#endif
+
 static int
 ipt_acct_release_device (struct inode *inode, struct file *file)
 {
-  device_opened_p = 0;
+  /* A generation held by a dead reader is to be read again. */
+  down (&read_sem);
+  if (reader == file)
+    {
+      reader = NULL;
+      spin_lock_bh (&dump_lock);
+      held_p = 0;
+      spin_unlock_bh (&dump_lock);
+    }
+  up (&read_sem);
+
   module_put (THIS_MODULE);
   return 0;
 }
@@ -468,8 +2077,23 @@ ipt_acct_release_device (struct inode *inode, struct file *file)
 static struct file_operations ipt_acct_device_ops =
 {
   .open = ipt_acct_open_device,
+  .llseek = no_llseek,
+  .read = ipt_acct_read_device,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 22)
+  .splice_read = ipt_acct_splice_read_device,
+#endif
   .poll = ipt_acct_poll_device,
-  .ioctl = ipt_acct_ioctl_device,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 11)
+  .unlocked_ioctl = ipt_acct_ioctl_device,
+# ifdef CONFIG_COMPAT
+  .compat_ioctl = ipt_acct_compat_ioctl_device,
+# endif
+#else
+  .ioctl = ipt_acct_locked_ioctl_device,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 0)
+  .mmap = ipt_acct_mmap_device,
+#endif
   .release = ipt_acct_release_device,
   .owner = THIS_MODULE
 };
@@ -496,106 +2120,429 @@ static struct ipt_target ipt_acct_target =
   .me = THIS_MODULE
 };
 
+/* Pools are mapped to the reader page by page, so whole pages are
+   cleared. */
+static struct ipt_acct_record *
+ipt_acct_alloc_records (unsigned int size)
+{
+  unsigned long length;
+  struct ipt_acct_record *records;
+
+  length = PAGE_ALIGN (size * sizeof (struct ipt_acct_record));
+  records = vmalloc (length);
+
+  if (records)
+    memset (records, 0, length);
+
+  return records;
+}
+
+static struct slot *
+ipt_acct_alloc_slots (unsigned int capacity, unsigned int *mask)
+{
+  unsigned int nslots;
+  struct slot *slots;
+
+  for (nslots = 2; nslots < capacity + capacity / 2; nslots *= 2)
+    ;
+
+  slots = vmalloc (nslots * sizeof (struct slot));
+
+  if (slots)
+    {
+      memset (slots, 0, nslots * sizeof (struct slot));
+      *mask = nslots - 1;
+    }
+
+  return slots;
+}
+
+static void
+ipt_acct_resize (void)
+{
+  struct ipt_acct_table *table;
+  struct ipt_acct_pool *pool;
+  struct ipt_acct_record *records;
+  struct slot *slots, *old;
+  unsigned int size, capacity, mask, resize_p;
+
+  down (&resize_sem);
+
+  /* Only free pools can be replaced. They become acct pools with the next
+     dumps. */
+  for (pool = &pools[0]; pool < &pools[ngenerations]; ++pool)
+    {
+      spin_lock_bh (&dump_lock);
+      size = target_size;
+      resize_p = (ipt_acct_pool_free_p (pool) && pool->size != size);
+      spin_unlock_bh (&dump_lock);
+
+      if (!resize_p)
+        continue;
+
+      records = ipt_acct_alloc_records (size);
+
+      if (!records)
+        break;
+
+      spin_lock_bh (&dump_lock);
+      if (ipt_acct_pool_free_p (pool) && pool->size != size)
+        {
+          struct ipt_acct_record *tmp = pool->records;
+          pool->records = records;
+          pool->size = size;
+          records = tmp;
+        }
+      spin_unlock_bh (&dump_lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 0)
+      /* Mapped pages of the old pool stay referenced until unmapped. */
+      if (map_mapping)
+        unmap_mapping_range (map_mapping, (loff_t) (pool - pools) * map_stride,
+                             map_stride, 1);
+#endif
+
+      vfree (records);
+    }
+
+  spin_lock_bh (&dump_lock);
+  size = target_size;
+  spin_unlock_bh (&dump_lock);
+
+  capacity = ipt_acct_table_capacity (size);
+
+  for_each_table (table)
+    {
+      spin_lock_bh (&table->lock);
+      old = table->old_slots;
+      table->old_slots = NULL;
+      resize_p = (table->capacity != capacity
+                  && (!table->next_slots || table->next_capacity != capacity));
+      spin_unlock_bh (&table->lock);
+
+      if (old)
+        vfree (old);
+
+      if (!resize_p)
+        continue;
+
+      slots = ipt_acct_alloc_slots (capacity, &mask);
+
+      if (!slots)
+        continue;
+
+      spin_lock_bh (&table->lock);
+      old = table->next_slots;
+      table->next_slots = slots;
+      table->next_mask = mask;
+      table->next_capacity = capacity;
+      spin_unlock_bh (&table->lock);
+
+      if (old)
+        vfree (old);
+    }
+
+  up (&resize_sem);
+}
+
+static void
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 20)
+ipt_acct_resize_work (struct work_struct *work)
+#else
+ipt_acct_resize_work (void *data)
+#endif
+{
+  ipt_acct_resize ();
+}
+
+static void
+ipt_acct_free_tables (void)
+{
+  struct ipt_acct_table *table;
+  unsigned int i;
+
+  if (ring)
+    {
+      vfree (ring);
+      ring = NULL;
+    }
+
+  if (stat_page)
+    {
+      free_page ((unsigned long) stat_page);
+      stat_page = NULL;
+    }
+
+  for (i = 0; i < NR_CPUS; ++i)
+    if (cpus[i].updates)
+      {
+        kfree (cpus[i].updates);
+        cpus[i].updates = NULL;
+      }
+
+  for (table = &tables[0]; table < &tables[NR_CPUS]; ++table)
+    {
+      if (table->slots)
+        vfree (table->slots);
+      if (table->next_slots)
+        vfree (table->next_slots);
+      if (table->old_slots)
+        vfree (table->old_slots);
+      table->slots = NULL;
+      table->next_slots = NULL;
+      table->old_slots = NULL;
+    }
+
+  if (pools)
+    {
+      struct ipt_acct_pool *pool;
+
+      for (pool = &pools[0]; pool < &pools[ngenerations]; ++pool)
+        if (pool->records)
+          vfree (pool->records);
+
+      kfree (pools);
+      pools = NULL;
+    }
+}
+
+static int
+ipt_acct_alloc_tables (void)
+{
+  struct ipt_acct_table *table;
+  struct ipt_acct_pool *pool;
+  unsigned int i, capacity;
+
+  pools = kmalloc (ngenerations * sizeof (struct ipt_acct_pool), GFP_KERNEL);
+
+  if (!pools)
+    return -ENOMEM;
+
+  memset (pools, 0, ngenerations * sizeof (struct ipt_acct_pool));
+
+  for (pool = &pools[0]; pool < &pools[ngenerations]; ++pool)
+    {
+      pool->size = target_size;
+      pool->records = ipt_acct_alloc_records (target_size);
+
+      if (!pool->records)
+        return -ENOMEM;
+    }
+
+  ntables = percpu_p ? NR_CPUS : 1;
+  capacity = ipt_acct_table_capacity (target_size);
+
+  for (i = 0; batch && i < NR_CPUS; ++i)
+    {
+      if (!cpu_possible (i))
+        continue;
+
+      cpus[i].updates = kmalloc (batch * sizeof (struct ipt_acct_update),
+                                 GFP_KERNEL);
+
+      if (!cpus[i].updates)
+        return -ENOMEM;
+    }
+
+  for (i = 0; i < ntables; ++i)
+    {
+      if (percpu_p && !cpu_possible (i))
+        continue;
+
+      table = &tables[i];
+      spin_lock_init (&table->lock);
+      table->capacity = capacity;
+      table->nused = 0;
+      table->gen = 1;
+      table->slots = ipt_acct_alloc_slots (capacity, &table->mask);
+
+      if (!table->slots)
+        return -ENOMEM;
+    }
+
+  acct_index = 0;
+  acct_pool = &pools[0];
+  acct_pool->seq = 1;
+  acct_pool->start_ts = get_seconds ();
+  npending = 0;
+  atomic_set (&acct_pool->nused, 0);
+
+  for_each_table (table)
+    table->pool = acct_pool;
+
+  return 0;
+}
+
 static int __init
 ip_acct_init (void)
 {
-  unsigned int i;
   int error;
+  unsigned int i;
 
   printk ("ipt_ACCT v%s\n", IPT_ACCT_VERSION);
 
   if (max_records == 0)
     max_records = DEFAULT_MAX_RECORDS;
 
-  startup_ts = 0;
-  records_lost = 0;
-  pkts_accted = 0;
-  pkts_not_accted = 0;
-  pkts_dropped = 0;
+  if (min_records == 0 || min_records > max_records)
+    min_records = max_records;
 
-  item_pool_0 = kmalloc (max_records * sizeof (struct item), GFP_KERNEL);
-  item_pool_1 = kmalloc (max_records * sizeof (struct item), GFP_KERNEL);
-  pool_0 = kmalloc (max_records * sizeof (struct ipt_acct_record), GFP_KERNEL);
-  pool_1 = kmalloc (max_records * sizeof (struct ipt_acct_record), GFP_KERNEL);
+  if (ngenerations < 2)
+    ngenerations = 2;
 
-  if (!item_pool_0 || !item_pool_1 || !pool_0 || !pool_1)
+  if (watermark == 0 || watermark > 100)
+    watermark = 100;
+
+  if (poll_watermark > 100)
+    poll_watermark = 100;
+
+  if (interval_ms == 0)
+    interval_ms = timeout * 1000;
+
+  if (ts_hz != 1 && ts_hz != 1000 && ts_hz != 1000000 && ts_hz != 1000000000)
+    ts_hz = 1;
+
+  if (batch > 256)
+    batch = 256;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION (2, 6, 0)
+  /* The ring and the statistics page cannot be mapped. */
+  ring_records = 0;
+  stat_ms = 0;
+#endif
+
+  ncpus = num_online_cpus ();
+  map_stride = PAGE_ALIGN ((unsigned long) max_records
+                           * sizeof (struct ipt_acct_record));
+  held_p = 0;
+
+  target_size = min_records;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 20)
+  INIT_WORK (&resize_work, ipt_acct_resize_work);
+  INIT_WORK (&dump_work, ipt_acct_dump_work);
+  INIT_WORK (&export_work, ipt_acct_export_work);
+#else
+  INIT_WORK (&resize_work, ipt_acct_resize_work, NULL);
+  INIT_WORK (&dump_work, ipt_acct_dump_work, NULL);
+  INIT_WORK (&export_work, ipt_acct_export_work, NULL);
+#endif
+  init_timer (&export_timer);
+  export_timer.function = ipt_acct_export_timer;
+
+  memset (cpus, 0, sizeof (cpus));
+  for (i = 0; i < NR_CPUS; ++i)
+    spin_lock_init (&cpus[i].lock);
+  get_random_bytes (&hash_seed, sizeof (hash_seed));
+
+  error = ipt_acct_alloc_tables ();
+
+  if (error != 0)
     {
-      if (item_pool_0)
-        kfree (item_pool_0);
-      if (item_pool_1)
-        kfree (item_pool_1);
-      if (pool_0)
-        kfree (pool_0);
-      if (pool_1)
-        kfree (pool_1);
-      return -ENOMEM;
+      ipt_acct_free_tables ();
+      return error;
     }
 
-  nlayers = max_records / 2;
+  exported_seq = 0;
+  nl_sock = NULL;
+  ring = NULL;
+  stat_page = NULL;
 
-  for (i = 0; i < sizeof (primes) / sizeof (primes[0]); ++i)
-    if (primes[i] > nlayers)
-      {
-        if (i == 0)
-          nlayers = primes[0];
-        else
-          nlayers = primes[i - 1];
-        break;
-      }
-
-  if (i == sizeof (primes) / sizeof (primes[0]))
-    nlayers = primes[i - 1];
+  if (stat_ms > 0)
+    {
+      stat_page = (struct ipt_acct_stat_page *) get_zeroed_page (GFP_KERNEL);
 
-  layers = kmalloc (nlayers * sizeof (struct item *), GFP_KERNEL);
+      if (!stat_page)
+        {
+          ipt_acct_free_tables ();
+          return -ENOMEM;
+        }
+    }
 
-  if (!layers)
+  if (ring_records > 0)
     {
-      kfree (item_pool_0);
-      kfree (item_pool_1);
-      kfree (pool_0);
-      kfree (pool_1);
-      return -ENOMEM;
+      ring_length = 2 * PAGE_SIZE
+                    + PAGE_ALIGN (ring_records
+                                  * sizeof (struct ipt_acct_record));
+      ring = vmalloc (ring_length);
+
+      if (!ring)
+        {
+          ipt_acct_free_tables ();
+          return -ENOMEM;
+        }
+
+      memset (ring, 0, ring_length);
+      ((struct ipt_acct_ring *) ring)->size = ring_records;
+      ring_size = ring_records;
+      ring_head = 0;
+      ring_pos = 0;
+      ring_seq = 0;
+      ring_first = 0;
     }
 
-  for (i = 0; i < nlayers; ++i)
-    layers[i] = NULL;
+  if (netlink_unit > 0)
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 24)
+      nl_sock = netlink_kernel_create (&init_net, netlink_unit, IPT_ACCT_NLGRP,
+                                       NULL, NULL, THIS_MODULE);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 22)
+      nl_sock = netlink_kernel_create (netlink_unit, IPT_ACCT_NLGRP, NULL,
+                                       NULL, THIS_MODULE);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 14)
+      nl_sock = netlink_kernel_create (netlink_unit, IPT_ACCT_NLGRP, NULL,
+                                       THIS_MODULE);
+#else
+      nl_sock = netlink_kernel_create (netlink_unit, NULL);
+#endif
 
-  acct_item_pool = item_pool_0;
-  dump_item_pool = item_pool_1;
-  free_item = &acct_item_pool[0];
-  acct_pool = pool_0;
-  dump_pool = pool_1;
-  free_record = &acct_pool[0];
-  ndump = 0;
+      if (!nl_sock)
+        {
+          ipt_acct_free_tables ();
+          return -ENOMEM;
+        }
+    }
 
-  device_opened_p = 0;
+  reader = NULL;
   error = misc_register (&ipt_acct_device);
 
   if (error != 0)
     {
-      kfree (layers);
-      kfree (pool_0);
-      kfree (pool_1);
-      kfree (item_pool_0);
-      kfree (item_pool_1);
+      ipt_acct_release_netlink ();
+      ipt_acct_free_tables ();
       return error;
     }
 
-  if (timeout > 0)
+  if (ipt_register_target (&ipt_acct_target) != 0)
+    {
+      misc_deregister (&ipt_acct_device);
+      ipt_acct_release_netlink ();
+      ipt_acct_free_tables ();
+      return -EINVAL;
+    }
+
+  /* Armed last, so that a failed load never leaves it pending. */
+  if (interval_ms > 0)
     {
       init_timer (&dump_timer);
       dump_timer.function = ipt_acct_dump_timer;
+      dump_timer.expires = jiffies + ipt_acct_dump_delay ();
+      add_timer (&dump_timer);
     }
 
-  if (ipt_register_target (&ipt_acct_target) != 0)
+  if (batch > 0)
     {
-      misc_deregister (&ipt_acct_device);
-      kfree (layers);
-      kfree (pool_0);
-      kfree (pool_1);
-      kfree (item_pool_0);
-      kfree (item_pool_1);
-      return -EINVAL;
+      init_timer (&flush_timer);
+      flush_timer.function = ipt_acct_flush_timer;
+      flush_timer.expires = jiffies + ipt_acct_ms_to_jiffies (batch_ms);
+      add_timer (&flush_timer);
+    }
+
+  if (stat_ms > 0)
+    {
+      init_timer (&stat_timer);
+      stat_timer.function = ipt_acct_stat_timer;
+      stat_timer.expires = jiffies;
+      add_timer (&stat_timer);
     }
 
   return 0;
@@ -606,14 +2553,19 @@ ip_acct_exit (void)
 {
   printk ("unloading ipt_ACCT v%s\n", IPT_ACCT_VERSION);
   ipt_unregister_target (&ipt_acct_target);
-  if (timeout > 0 && timer_pending (&dump_timer))
-    del_timer (&dump_timer);
+  if (interval_ms > 0)
+    del_timer_sync (&dump_timer);
+  if (batch > 0)
+    del_timer_sync (&flush_timer);
+  if (stat_ms > 0)
+    del_timer_sync (&stat_timer);
   misc_deregister (&ipt_acct_device);
-  kfree (layers);
-  kfree (pool_0);
-  kfree (pool_1);
-  kfree (item_pool_0);
-  kfree (item_pool_1);
+  /* With no opener left the export takes read_sem at once and does not
+     arm the timer again. */
+  del_timer_sync (&export_timer);
+  flush_scheduled_work ();
+  ipt_acct_release_netlink ();
+  ipt_acct_free_tables ();
 }
 
 module_init (ip_acct_init);
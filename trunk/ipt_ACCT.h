@@ -29,19 +29,86 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
-#define IPT_ACCT_VERSION "0.06"
+#define IPT_ACCT_VERSION "0.07"
 
 #define IPT_ACCT_MAJIC 241
 #define IPT_ACCT_DEVICE "ipt_acct"
 
 /* Obtain maximum dump size in records. */
 #define IPT_ACCT_GET_MAX _IO (IPT_ACCT_MAJIC, 0)
-/* Force dump if had not one in case of zero timeout. */
+/* Force dump if had not one in case of zero timeout, or once the dump
+   has reached the poll_watermark module parameter. poll() reports POLLPRI
+   once per generation and open file when that happens. */
 #define IPT_ACCT_DUMP _IO (IPT_ACCT_MAJIC, 1)
-/* Get accounting records from dump. */
+/* Get accounting records from dump. Records can be read() in chunks of any
+   whole number of records as well, the read returning 0 ends a dump. */
 #define IPT_ACCT_GET_DUMP _IOW (IPT_ACCT_MAJIC, 2, void *)
 /* Obtain statistics. */
 #define IPT_ACCT_GET_STAT _IOW (IPT_ACCT_MAJIC, 3, void *)
+/* Describe the dump generation last returned by IPT_ACCT_GET_DUMP or read
+   up with read(). */
+#define IPT_ACCT_GET_GENERATION _IOW (IPT_ACCT_MAJIC, 4, void *)
+/* Hold the oldest dump generation and describe it. Its records can be
+   read in place at the given offset of the device memory map (2.6 kernels
+   only) until IPT_ACCT_RELEASE_DUMP. */
+#define IPT_ACCT_HOLD_DUMP _IOW (IPT_ACCT_MAJIC, 5, void *)
+/* Release the held dump generation. */
+#define IPT_ACCT_RELEASE_DUMP _IO (IPT_ACCT_MAJIC, 6)
+/* Get a range of records of the held dump generation, returns the number
+   of records copied. Openers other than the reader get a copy of the
+   oldest dump generation not released yet instead, which leaves it to the
+   reader, and zero when there is none. */
+#define IPT_ACCT_GET_DUMP_RANGE _IOW (IPT_ACCT_MAJIC, 7, void *)
+/* Locate the ring of records in the device memory map. */
+#define IPT_ACCT_GET_RING _IOW (IPT_ACCT_MAJIC, 8, void *)
+/* Get the offset of the statistics page in the device memory map. */
+#define IPT_ACCT_GET_STAT_PAGE _IOW (IPT_ACCT_MAJIC, 9, void *)
+
+/* With the netlink_unit module parameter every dump generation is
+   multicast to group IPT_ACCT_NLGRP of that netlink protocol as an
+   IPT_ACCT_NLMSG_GENERATION message carrying struct ipt_acct_generation,
+   IPT_ACCT_NLMSG_RECORDS messages carrying arrays of records and an
+   NLMSG_DONE message. All of them have the sequence number of the
+   generation. */
+#define IPT_ACCT_NLGRP 1
+#define IPT_ACCT_NLMSG_GENERATION 0x10
+#define IPT_ACCT_NLMSG_RECORDS 0x11
+
+/* With the ring_records module parameter dumps are exported continuously
+   through a ring instead. The area described by IPT_ACCT_GET_RING holds
+   this header on its first page, struct ipt_acct_ring_tail on the second
+   and SIZE records from the third one on. The reader maps the area
+   read-only and the second page alone read-write. The module puts records
+   at HEAD and advances it, the reader takes them from TAIL and advances
+   that; record number I of the stream is at index I % SIZE. IPT_ACCT_GET_DUMP,
+   IPT_ACCT_HOLD_DUMP, read() and IPT_ACCT_GET_DUMP_RANGE of the reader
+   are refused while the ring is in use. poll() reports records in the
+   ring. */
+struct ipt_acct_ring
+{
+  __u64 head;
+  __u32 size;
+  __u32 reserved;
+};
+
+struct ipt_acct_ring_tail
+{
+  __u64 tail;
+};
+
+struct ipt_acct_ring_info
+{
+  __u64 offset;
+  __u64 length;
+};
+
+struct ipt_acct_dump_range
+{
+  /* Address of the buffer for COUNT records. */
+  __u64 records;
+  __u32 first;
+  __u32 count;
+};
 
 struct ipt_acct_stat
 {
@@ -50,8 +117,52 @@ struct ipt_acct_stat
   __u64 pkts_accted;
   __u64 pkts_not_accted;
   __u64 pkts_dropped;
+  /* Number of hash table buckets. */
+  __u64 nbuckets;
+  /* Number of flows accounted in the current dump generation. */
+  __u64 nflows;
+  /* Number of records the current dump generation can hold. */
+  __u64 capacity;
+  /* Number of dumps made, and how many of them a packet had to wait for
+     because the table filled up before the deferred dump. */
+  __u64 ndumps;
+  __u64 ndumps_inline;
+  /* Number of packets accounted without a hash table lookup, since they
+     belonged to the same flow as the previous packet on their CPU. */
+  __u64 last_hits;
+};
+
+/* With the stat_ms module parameter the statistics are also kept on a
+   page that anybody may map read-only, refreshed periodically. SEQ is odd
+   while the page is being written: a reader copies the page and retries
+   unless SEQ was even before and has not changed after. */
+struct ipt_acct_stat_page
+{
+  __u32 seq;
+  __u32 reserved;
+  struct ipt_acct_stat stat;
+  /* Sequence number of the dump generation being accounted. */
+  __u64 generation;
+  /* Number of dumps waiting to be read, of at most NGENERATIONS - 1. */
+  __u32 npending;
+  __u32 ngenerations;
+};
+
+/* Dump generations are numbered consecutively starting from 1, so a gap
+   in SEQ means that generations have been lost. */
+struct ipt_acct_generation
+{
+  __u64 seq;
+  __u64 start_ts;
+  __u64 end_ts;
+  __u64 offset;
+  __u32 nrecords;
+  /* Units of FIRST and LAST of the records per second. */
+  __u32 ts_hz;
 };
 
+/* Grew CPU and RESERVED in 0.07, which made it 48 bytes on 32-bit
+   platforms as well: collectors built against 0.06 must be rebuilt. */
 struct ipt_acct_record
 {
   __u32 src;
@@ -60,10 +171,15 @@ struct ipt_acct_record
   __u16 dport;
   __u32 npkts;
   __u32 size;
+  /* Keeps FIRST aligned the same way for 32-bit and 64-bit programs. */
+  __u32 reserved;
   __u64 first;
   __u64 last;
   __u8 proto;
   __u16 magic;
+  /* Number of CPU that has accounted the record (0 unless the module is
+     loaded with percpu_p=1). */
+  __u16 cpu;
 };
 
 #endif /* IPT_ACCT_H */
@@ -27,6 +27,7 @@
 #include <sys/poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <fcntl.h>
@@ -46,6 +47,7 @@ static const struct option options[] =
 {
   { "version", 0, 0, 0 },
   { "help", 0, 0, 0 },
+  { "mmap", 0, 0, 'm' },
   { 0, 0, 0, 0}
 };
 
@@ -55,6 +57,9 @@ usage ()
   printf ("\
 Usage: stat_ipt_acct [options]\n\
 Options:\n\
+  -m, --mmap\n\
+     Read the statistics page of the module (the stat_ms module parameter)\n\
+     instead of asking the module for them.\n\
   --version\n\
      Print program version and exit.\n\
   --help\n\
@@ -67,16 +72,83 @@ version ()
   printf ("stat_ipt_acct %s\n", IPT_ACCT_VERSION);
 }
 
+static void
+print_stat (const struct ipt_acct_stat *stat)
+{
+  if (stat->startup_ts == 0)
+    printf ("Accounting since: no data accounted\n");
+  else
+    printf ("Accounting since: %s",
+            asctime (localtime ((time_t *) &stat->startup_ts)));
+  printf ("Records lost: %" PRIu64 "\n", stat->records_lost);
+  printf ("Packets accounted: %" PRIu64 "\n", stat->pkts_accted);
+  printf ("Not accounted critical packets: %" PRIu64 "\n",
+	  stat->pkts_not_accted);
+  printf ("Packets dropped: %" PRIu64 "\n", stat->pkts_dropped);
+  printf ("Flows: %" PRIu64 " of %" PRIu64 "\n", stat->nflows,
+          stat->capacity);
+  if (stat->pkts_accted != 0)
+    printf ("Last flow hits: %" PRIu64 " (%.1f%%)\n", stat->last_hits,
+            100.0 * stat->last_hits / stat->pkts_accted);
+  printf ("Dumps: %" PRIu64 " (%" PRIu64 " in packet path)\n",
+          stat->ndumps, stat->ndumps_inline);
+  printf ("Hash buckets: %" PRIu64 "\n", stat->nbuckets);
+  if (stat->nbuckets != 0)
+    printf ("Load factor: %.2f\n", (double) stat->nflows / stat->nbuckets);
+}
+
+/* Take a consistent copy of the statistics page, without system calls
+   once it is mapped. */
+static int
+read_stat_page (int acct_dev, struct ipt_acct_stat_page *copy)
+{
+  volatile struct ipt_acct_stat_page *page;
+  __u64 offset;
+  __u32 seq;
+
+  if (ioctl (acct_dev, IPT_ACCT_GET_STAT_PAGE, &offset) == -1)
+    {
+      ERROR ("IPT_ACCT_GET_STAT_PAGE: %s", strerror (errno));
+      return 3;
+    }
+
+  page = mmap (NULL, sysconf (_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+               acct_dev, offset);
+
+  if (page == MAP_FAILED)
+    {
+      ERROR ("Mapping of /dev/%s failed: %s", IPT_ACCT_DEVICE,
+             strerror (errno));
+      return 3;
+    }
+
+  do
+    {
+      while ((seq = page->seq) & 1)
+        ;
+      __sync_synchronize ();
+      memcpy (copy, (const void *) page, sizeof (*copy));
+      __sync_synchronize ();
+    }
+  while (page->seq != seq);
+
+  munmap ((void *) page, sysconf (_SC_PAGESIZE));
+  return 0;
+}
+
 int
 main (int argc, char * const argv[])
 {
   int c, option_index;
   int acct_dev;
   struct ipt_acct_stat stat;
+  struct ipt_acct_stat_page page;
+  int mmap_p = 0;
+  int result;
 
   while (1)
     {
-      c = getopt_long (argc, argv, "", options, &option_index);
+      c = getopt_long (argc, argv, "m", options, &option_index);
 
       if (c == -1)
         break;
@@ -89,6 +161,9 @@ main (int argc, char * const argv[])
           else
             usage ();
           return 0;
+        case 'm':
+          mmap_p = 1;
+          break;
         case '?':
           return 1;
         }
@@ -111,22 +186,27 @@ main (int argc, char * const argv[])
       return 2;
     }
 
+  if (mmap_p)
+    {
+      result = read_stat_page (acct_dev, &page);
+
+      if (result != 0)
+        return result;
+
+      print_stat (&page.stat);
+      printf ("Generation: %" PRIu64 "\n", page.generation);
+      printf ("Pending dumps: %u of %u\n", page.npending,
+              page.ngenerations - 1);
+      return 0;
+    }
+
   if (ioctl (acct_dev, IPT_ACCT_GET_STAT, &stat) == -1)
     {
       ERROR ("IPT_ACCT_GET_STAT: %s", strerror (errno));
       return 3;
     }
 
-  if (stat.startup_ts == 0)
-    printf ("Accounting since: no data accounted\n");
-  else
-    printf ("Accounting since: %s",
-            asctime (localtime ((time_t *) &stat.startup_ts)));
-  printf ("Records lost: %" PRIu64 "\n", stat.records_lost);
-  printf ("Packets accounted: %" PRIu64 "\n", stat.pkts_accted);
-  printf ("Not accounted critical packets: %" PRIu64 "\n",
-	  stat.pkts_not_accted);
-  printf ("Packets dropped: %" PRIu64 "\n", stat.pkts_dropped);
+  print_stat (&stat);
 
   return 0;
 }